@@ -15,6 +15,19 @@ using namespace Eigen;
 
 #include "ceres/ceres.h"
 
+// The per-landmark results held by the cost functions: the tm0 and tm of the
+// landmark's model, and its tm1 for the identity cost functions, without its
+// core, which the evaluations never read.
+// Landmarks of cores with these id/exp ranks evaluate on fixed-size matrices,
+// cores of any other rank fall back to dynamic ones at runtime.
+#ifndef LANDMARK_MODEL_ID_RANK
+#define LANDMARK_MODEL_ID_RANK 50
+#endif
+#ifndef LANDMARK_MODEL_EXP_RANK
+#define LANDMARK_MODEL_EXP_RANK 25
+#endif
+using LandmarkModel = LandmarkResults<LANDMARK_MODEL_ID_RANK, LANDMARK_MODEL_EXP_RANK>;
+
 inline glm::dvec3 ProjectPoint_ref(const glm::dvec3 &p, const glm::dmat4 &Mview,
                                    const CameraParameters &cam_params) {
   const double fovy = cam_params.fovy;
@@ -133,9 +146,11 @@ struct PoseCostFunction {
     return true;
   }
 
-  MultilinearModel model;
+  LandmarkModel model;
   Constraint2D constraint;
   CameraParameters cam_params;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
 struct PoseRegularizationTerm {
@@ -295,9 +310,11 @@ struct PoseCostFunction_analytic : public ceres::SizedCostFunction<2, 3, 3> {
     return true;
   }
 
-  MultilinearModel model;
+  LandmarkModel model;
   Constraint2D constraint;
   CameraParameters cam_params;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
 struct PositionCostFunction {
@@ -326,10 +343,12 @@ struct PositionCostFunction {
     return true;
   }
 
-  MultilinearModel model;
+  LandmarkModel model;
   Constraint2D constraint;
   CameraParameters cam_params;
   double theta_z;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
 struct PositionCostFunction_analytic : public ceres::SizedCostFunction<2, 3> {
@@ -387,28 +406,32 @@ struct PositionCostFunction_analytic : public ceres::SizedCostFunction<2, 3> {
     return true;
   }
 
-  MultilinearModel model;
+  LandmarkModel model;
   Constraint2D constraint;
   CameraParameters cam_params;
   double theta_z;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
 struct IdentityCostFunction {
-  IdentityCostFunction(const MultilinearModel &model,
+  IdentityCostFunction(MultilinearModel &model,
                        const Constraint2D &constraint,
                        int params_length,
                        const glm::mat4 &Mview,
                        const CameraParameters &cam_params)
     : model(model), constraint(constraint),
       params_length(params_length),
-      Mview(Mview), cam_params(cam_params) { }
+      Mview(Mview), cam_params(cam_params) {
+    this->model.CopyTM1(model);
+  }
 
   bool operator()(const double *const *wid, double *residual) const {
     // Apply the weight vector to the model
-    model.UpdateTMWithTM1(Map<const VectorXd>(wid[0], params_length).eval());
+    LandmarkModel::TMVector tm;
+    model.EvaluateWithTM1(Map<const VectorXd>(wid[0], params_length), tm);
 
     // Project the point to image plane
-    auto tm = model.GetTM();
     glm::dvec3 q = ProjectPoint(glm::dvec3(tm[0], tm[1], tm[2]),
                                 Mview,
                                 cam_params);
@@ -419,15 +442,17 @@ struct IdentityCostFunction {
     return true;
   }
 
-  mutable MultilinearModel model;
+  LandmarkModel model;
   Constraint2D constraint;
   int params_length;
   glm::dmat4 Mview;
   CameraParameters cam_params;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
 struct IdentityCostFunction_analytic : public ceres::CostFunction {
-  IdentityCostFunction_analytic(const MultilinearModel &model,
+  IdentityCostFunction_analytic(MultilinearModel &model,
                                 const Constraint2D &constraint,
                                 int params_length,
                                 const glm::dmat4 &Mview,
@@ -437,6 +462,7 @@ struct IdentityCostFunction_analytic : public ceres::CostFunction {
     : model(model), constraint(constraint),
       params_length(params_length),
       Mview(Mview), Rmat(Rmat), cam_params(cam_params), weight(weight) {
+    this->model.CopyTM1(model);
     mutable_parameter_block_sizes()->clear();
     mutable_parameter_block_sizes()->push_back(params_length);
     set_num_residuals(1);
@@ -454,8 +480,8 @@ struct IdentityCostFunction_analytic : public ceres::CostFunction {
       double residual_p, residual_m;
 
       {
-        model.UpdateTMWithTM1(wid_vec_p);
-        auto tm = model.GetTM();
+        LandmarkModel::TMVector tm;
+        model.EvaluateWithTM1(wid_vec_p, tm);
         glm::dvec3 q = ProjectPoint(glm::dvec3(tm[0], tm[1], tm[2]),
                                     Mview,
                                     cam_params);
@@ -464,8 +490,8 @@ struct IdentityCostFunction_analytic : public ceres::CostFunction {
       }
 
       {
-        model.UpdateTMWithTM1(wid_vec_m);
-        auto tm = model.GetTM();
+        LandmarkModel::TMVector tm;
+        model.EvaluateWithTM1(wid_vec_m, tm);
         glm::dvec3 q = ProjectPoint(glm::dvec3(tm[0], tm[1], tm[2]),
                                     Mview,
                                     cam_params);
@@ -482,10 +508,10 @@ struct IdentityCostFunction_analytic : public ceres::CostFunction {
                         double *residuals,
                         double **jacobians) const {
     // Apply the weight vector to the model
-    model.UpdateTMWithTM1(Map<const VectorXd>(wid[0], params_length).eval());
+    LandmarkModel::TMVector tm;
+    model.EvaluateWithTM1(Map<const VectorXd>(wid[0], params_length), tm);
 
     // Project the point to image plane
-    auto tm = model.GetTM();
     glm::dvec3 q = ProjectPoint(glm::dvec3(tm[0], tm[1], tm[2]),
                                 Mview,
                                 cam_params);
@@ -496,7 +522,7 @@ struct IdentityCostFunction_analytic : public ceres::CostFunction {
 
     if (jacobians != NULL) {
       assert(jacobians[0] != NULL);
-      // J = Jh * R * tm1^T
+      // J = Jh * R * tm1
 
       Vector2d fvec;
       fvec[0] = q.x - constraint.data.x;
@@ -532,10 +558,9 @@ struct IdentityCostFunction_analytic : public ceres::CostFunction {
       R(2, 1) = Rmat[1][2];
       R(2, 2) = Rmat[2][2];
 
-      // tm1 is a ndims_id x 3 matrix, where each row is x, y, z
-      auto tm1 = model.GetTM1().GetData();
-      auto J = (scale_factor * fvec.transpose() * Jh * R *
-                tm1.transpose()).eval();
+      // tm1 is a 3 x ndims_id matrix, whose rows are x, y, z
+      const auto &tm1 = model.GetTM1();
+      auto J = (scale_factor * fvec.transpose() * Jh * R * tm1).eval();
 
       for (int i = 0; i < params_length; ++i) jacobians[0][i] = J(0, i) * weight;
     }
@@ -543,12 +568,14 @@ struct IdentityCostFunction_analytic : public ceres::CostFunction {
     return true;
   }
 
-  mutable MultilinearModel model;
+  LandmarkModel model;
   Constraint2D constraint;
   int params_length;
   glm::dmat4 Mview, Rmat;
   CameraParameters cam_params;
   double weight;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
 struct ExpressionCostFunction {
@@ -564,10 +591,10 @@ struct ExpressionCostFunction {
     VectorXd wexp_vec = Map<const VectorXd>(wexp[0], params_length).eval();
 
     // Apply the weight vector to the model
-    model.UpdateTMWithTM0(wexp_vec);
+    LandmarkModel::TMVector tm;
+    model.EvaluateWithTM0(wexp_vec, tm);
 
     // Project the point to image plane
-    auto tm = model.GetTM();
     glm::dvec3 p(tm[0], tm[1], tm[2]);
     //cout << p.x << ", " << p.y << ", " << p.z << endl;
     glm::dvec3 q = ProjectPoint(p, Mview, cam_params);
@@ -578,11 +605,13 @@ struct ExpressionCostFunction {
     return true;
   }
 
-  mutable MultilinearModel model;
+  LandmarkModel model;
   Constraint2D constraint;
   int params_length;
   glm::dmat4 Mview;
   CameraParameters cam_params;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
 struct ExpressionCostFunction_analytic : public ceres::CostFunction {
@@ -604,10 +633,10 @@ struct ExpressionCostFunction_analytic : public ceres::CostFunction {
     VectorXd wexp_vec = Map<const VectorXd>(wexp[0], params_length).eval();
 
     // Apply the weight vector to the model
-    model.UpdateTMWithTM0(wexp_vec);
+    LandmarkModel::TMVector tm;
+    model.EvaluateWithTM0(wexp_vec, tm);
 
     // Project the point to image plane
-    auto tm = model.GetTM();
     glm::dvec3 p(tm[0], tm[1], tm[2]);
     //cout << p.x << ", " << p.y << ", " << p.z << endl;
     glm::dvec3 q = ProjectPoint(p, Mview, cam_params);
@@ -655,7 +684,7 @@ struct ExpressionCostFunction_analytic : public ceres::CostFunction {
       R(2, 2) = Rmat[2][2];
 
       // tm1 is a ndims_id x 3 matrix, where each row is x, y, z
-      auto tm0 = model.GetTM0().GetData();
+      const auto &tm0 = model.GetTM0();
       auto J = (scale_factor * fvec.transpose() * Jh * R *
                 tm0.transpose()).eval();
 
@@ -665,11 +694,13 @@ struct ExpressionCostFunction_analytic : public ceres::CostFunction {
     return true;
   }
 
-  mutable MultilinearModel model;
+  LandmarkModel model;
   Constraint2D constraint;
   int params_length;
   glm::dmat4 Mview, Rmat;
   CameraParameters cam_params;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
 struct ExpressionCostFunction_FACS {
@@ -680,23 +711,16 @@ struct ExpressionCostFunction_FACS {
                               const MatrixXd &Uexp,
                               const CameraParameters &cam_params)
     : model(model), constraint(constraint), params_length(params_length),
-      Mview(Mview), Uexp(Uexp), cam_params(cam_params) { }
+      Mview(Mview), cam_params(cam_params) {
+    this->model.SetFACSBasis(Uexp);
+  }
 
   bool operator()(const double *const *wexp, double *residual) const {
-#if 0
-    VectorXd wexp_vec = Map<const VectorXd>(wexp[0], params_length).eval();
-#else
-    VectorXd wexp_vec(params_length);
-    wexp_vec.bottomRows(params_length-1) = Map<const VectorXd>(wexp[0], params_length - 1).eval();
-    wexp_vec[0] = 1.0 - wexp_vec.bottomRows(params_length-1).sum();
-#endif
-    VectorXd weights = (wexp_vec.transpose() * Uexp).eval();
-
-    // Apply the weight vector to the model
-    model.UpdateTMWithTM0(weights);
+    // Apply the last 46 FACS weights to the model, the first one is implied
+    LandmarkModel::TMVector tm;
+    model.EvaluateFACS(Map<const VectorXd>(wexp[0], params_length - 1), tm);
 
     // Project the point to image plane
-    auto tm = model.GetTM();
     glm::dvec3 p(tm[0], tm[1], tm[2]);
     glm::dvec3 q = ProjectPoint(p, Mview, cam_params);
     // Compute residual
@@ -705,12 +729,13 @@ struct ExpressionCostFunction_FACS {
     return true;
   }
 
-  mutable MultilinearModel model;
+  LandmarkModel model;
   Constraint2D constraint;
   int params_length;
   glm::dmat4 Mview;
-  const MatrixXd &Uexp;
   CameraParameters cam_params;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
 struct ExpressionCostFunction_FACS_analytic : public ceres::CostFunction {
@@ -723,6 +748,7 @@ struct ExpressionCostFunction_FACS_analytic : public ceres::CostFunction {
                                        const CameraParameters &cam_params)
     : model(model), constraint(constraint), params_length(params_length),
       Mview(Mview), Rmat(Rmat), Uexp(Uexp), cam_params(cam_params) {
+    this->model.SetFACSBasis(Uexp);
     mutable_parameter_block_sizes()->clear();
     mutable_parameter_block_sizes()->push_back(params_length - 1);
     set_num_residuals(1);
@@ -748,8 +774,8 @@ struct ExpressionCostFunction_FACS_analytic : public ceres::CostFunction {
       double residual_p, residual_m;
 
       {
-        model.UpdateTMWithTM0((wexp_vec_p.transpose() * Uexp).eval());
-        auto tm = model.GetTM();
+        LandmarkModel::TMVector tm;
+        model.EvaluateWithTM0((wexp_vec_p.transpose() * Uexp).eval(), tm);
         glm::dvec3 q = ProjectPoint(glm::dvec3(tm[0], tm[1], tm[2]),
                                     Mview,
                                     cam_params);
@@ -758,8 +784,8 @@ struct ExpressionCostFunction_FACS_analytic : public ceres::CostFunction {
       }
 
       {
-        model.UpdateTMWithTM0((wexp_vec_m.transpose() * Uexp).eval());
-        auto tm = model.GetTM();
+        LandmarkModel::TMVector tm;
+        model.EvaluateWithTM0((wexp_vec_m.transpose() * Uexp).eval(), tm);
         glm::dvec3 q = ProjectPoint(glm::dvec3(tm[0], tm[1], tm[2]),
                                     Mview,
                                     cam_params);
@@ -774,21 +800,11 @@ struct ExpressionCostFunction_FACS_analytic : public ceres::CostFunction {
 
   bool Evaluate(const double *const *wexp, double *residuals,
                 double **jacobians) const {
-#if 0
-    VectorXd wexp_vec = Map<const VectorXd>(wexp[0], params_length).eval();
-#else
-    VectorXd wexp_vec(params_length);
-    wexp_vec.bottomRows(params_length-1) = Map<const VectorXd>(wexp[0], params_length - 1).eval();
-    wexp_vec[0] = 1.0 - wexp_vec.bottomRows(params_length-1).sum();
-#endif
-
-    VectorXd weights = (wexp_vec.transpose() * Uexp).eval();
-
-    // Apply the weight vector to the model
-    model.UpdateTMWithTM0(weights);
+    // Apply the last 46 FACS weights to the model, the first one is implied
+    LandmarkModel::TMVector tm;
+    model.EvaluateFACS(Map<const VectorXd>(wexp[0], params_length - 1), tm);
 
     // Project the point to image plane
-    auto tm = model.GetTM();
     glm::dvec3 p(tm[0], tm[1], tm[2]);
     glm::dvec3 q = ProjectPoint(p, Mview, cam_params);
     // Compute residual
@@ -833,16 +849,9 @@ struct ExpressionCostFunction_FACS_analytic : public ceres::CostFunction {
       R(2, 1) = Rmat[1][2];
       R(2, 2) = Rmat[2][2];
 
-      MatrixXd D = MatrixXd::Zero(params_length, params_length-1);
-      for(int i=0;i<params_length-1;++i) {
-        D(0, i) = -1.0;
-        D(i+1, i) = 1.0;
-      }
-
-      // tm0 is a ndims_exp x 3 matrix, where each row is x, y, z
-      auto tm0 = model.GetTM0().GetData();
-      auto J = (scale_factor * fvec.transpose() * Jh * R * tm0.transpose() *
-                Uexp.transpose() * D).eval();
+      // the FACS basis is the Jacobian of tm, 3 x 46
+      const auto &B = model.GetFACSBasis();
+      auto J = (scale_factor * fvec.transpose() * Jh * R * B).eval();
 
       for (int i = 0; i < params_length - 1; ++i) jacobians[0][i] = J(0, i);
     }
@@ -850,12 +859,14 @@ struct ExpressionCostFunction_FACS_analytic : public ceres::CostFunction {
     return true;
   }
 
-  mutable MultilinearModel model;
+  LandmarkModel model;
   Constraint2D constraint;
   int params_length;
   glm::dmat4 Mview, Rmat;
   const MatrixXd &Uexp;
   CameraParameters cam_params;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
 struct PriorCostFunction {
@@ -906,20 +917,16 @@ struct ExpressionRegularizationCostFunction {
   ExpressionRegularizationCostFunction(const VectorXd &prior_vec,
                                        const MatrixXd &inv_cov_mat,
                                        const MatrixXd &Uexp, double weight)
-    : prior_vec(prior_vec), inv_cov_mat(inv_cov_mat), Uexp(Uexp),
-      weight(weight) { }
+    : inv_cov_mat(inv_cov_mat), weight(weight) {
+    // Uexp^T (1 - sum(x), x) - prior_vec = diff0 + Uexp_x * x
+    diff0 = Uexp.row(0).transpose() - prior_vec;
+    Uexp_x = (Uexp.bottomRows(Uexp.rows() - 1).rowwise() - Uexp.row(0)).transpose();
+  }
 
   bool operator()(const double *const *w, double *residual) const {
-    const int params_length = 47;
-#if 0
-    VectorXd wexp_vec = Map<const VectorXd>(w[0], params_length).eval();
-#else
-    VectorXd wexp_vec(params_length);
-    wexp_vec.bottomRows(params_length-1) = Map<const VectorXd>(w[0], params_length - 1).eval();
-    wexp_vec[0] = 1.0 - wexp_vec.bottomRows(params_length-1).sum();
-#endif
-
-    VectorXd diff = (Uexp.transpose() * wexp_vec - prior_vec).eval();
+    const int params_length = Uexp_x.cols();
+    VectorXd diff = diff0;
+    diff.noalias() += Uexp_x * Map<const VectorXd>(w[0], params_length);
 
     // Simply Mahalanobis distance between w and prior_vec
     residual[0] = sqrt(fabs(weight * diff.transpose() * (inv_cov_mat * diff)));
@@ -927,9 +934,9 @@ struct ExpressionRegularizationCostFunction {
     return true;
   }
 
-  const VectorXd &prior_vec;
   const MatrixXd &inv_cov_mat;
-  const MatrixXd &Uexp;
+  VectorXd diff0;
+  MatrixXd Uexp_x;    // expression weights per FACS weight, neutral folded in
   double weight;
 };
 
@@ -228,11 +228,11 @@ public:
   MultiImageReconstructor() {}
 
   void LoadModel(const string& filename) {
-    model = MultilinearModel(filename);
-    single_recon.LoadModel(filename);
+    model = MultilinearModel::Shared(filename);
+    single_recon.SetModel(model);
   }
   void LoadPriors(const string& filename_id, const string& filename_exp) {
-    prior.load(filename_id, filename_exp);
+    prior = *MultilinearModelPrior::Shared(filename_id, filename_exp);
     single_recon.LoadPriors(filename_id, filename_exp);
   }
   void SetContourIndices(const vector<vector<int>>& contour_indices_in) {
@@ -910,7 +910,7 @@ bool MultiImageReconstructor<Constraint>::Reconstruct() {
           // Create a projected model first
           vector<MultilinearModel> model_projected_i(param_sets[i].indices.size());
           for(size_t j=0;j<param_sets[i].indices.size();++j) {
-            model_projected_i[j] = model.project(vector<int>(1, param_sets[i].indices[j]));
+            model_projected_i[j] = model.projected(param_sets[i].indices[j]);
             model_projected_i[j].ApplyWeights(param_sets[i].model.Wid, param_sets[i].model.Wexp);
           }
 
@@ -1,84 +1,463 @@
 #include "multilinearmodel.h"
 
+#include <mutex>
+#include <unordered_map>
+
+struct MultilinearModel::VertexSubset {
+  vector<int> vertices;
+  MultilinearModel model;   // project(vertices)
+};
+
+struct MultilinearModel::ProjectionCache {
+  std::mutex mutex;
+  std::unordered_map<int, MultilinearModel> models;
+  std::unordered_map<string, shared_ptr<const VertexSubset>> subsets;
+};
+
+MultilinearModel::MultilinearModel()
+  : precision(Double), data(make_shared<CoreData>())
+{
+}
+
 MultilinearModel::MultilinearModel(const string &filename)
+  : precision(Double), projection_cache(make_shared<ProjectionCache>())
 {
+  Tensor3 core;
   core.Read(filename);
-  UnfoldCoreTensor();
+  SetCore(std::move(core));
+}
+
+MultilinearModel MultilinearModel::Shared(const string &filename)
+{
+  // the registry only keeps weak references, a model is freed with its last
+  // user and read again by the next one
+  struct Entry {
+    std::weak_ptr<const CoreData> data;
+    std::weak_ptr<ProjectionCache> cache;
+  };
+  static std::mutex mutex;
+  static std::unordered_map<string, Entry> registry;
+
+  auto lookup = [&](MultilinearModel &model) {
+    auto it = registry.find(filename);
+    if( it == registry.end() ) return false;
+    model.data = it->second.data.lock();
+    model.projection_cache = it->second.cache.lock();
+    if( model.data && model.projection_cache ) return true;
+    // the last user of the model is gone
+    registry.erase(it);
+    return false;
+  };
+
+  MultilinearModel model;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if( lookup(model) ) return model;
+  }
+
+  // read outside the lock, other files can be looked up meanwhile. Of two
+  // threads reading the same file, the first to publish its model wins.
+  MultilinearModel loaded(filename);
+  std::lock_guard<std::mutex> lock(mutex);
+  if( lookup(model) ) return model;
+  registry[filename] = Entry{loaded.data, loaded.projection_cache};
+  return loaded;
 }
 
 MultilinearModel MultilinearModel::project(const vector<int> &indices) const
 {
   //cout << "creating projected tensors..." << endl;
   // create a projected version of the model
-  MultilinearModel newmodel;
-  newmodel.core.resize(core.layers(), core.rows(), indices.size() * 3);
-
-  for (int i = 0; i < core.layers(); i++) {
-    for (int j = 0; j < core.rows(); j++) {
-      for (int k = 0, idx = 0; k < indices.size(); k++, idx += 3) {
-        int vidx = indices[k] * 3;
-        newmodel.core(i, j, idx) = core(i, j, vidx);
-        newmodel.core(i, j, idx + 1) = core(i, j, vidx + 1);
-        newmodel.core(i, j, idx + 2) = core(i, j, vidx + 2);
-      }
+  const int l = data->layers, m = data->rows;
+  Tensor3 newcore(l, m, indices.size() * 3);
+
+  // the 3 coordinates of a vertex are 3 adjacent columns of each layer
+  for (int i = 0; i < l; i++) {
+    double *dst = newcore.layer(i).data();
+    for (int k = 0; k < indices.size(); k++) {
+      GatherColumns(i, indices[k] * 3, 3, dst + static_cast<size_t>(k) * 3 * m);
     }
   }
 
-  newmodel.UnfoldCoreTensor();
+  MultilinearModel newmodel;
+  newmodel.precision = precision;
+  newmodel.SetCore(std::move(newcore));
 
   return newmodel;
 }
 
-void MultilinearModel::UpdateTM0(const Tensor1 &w)
+vector<MultilinearModel> MultilinearModel::projectEach(const vector<int> &indices) const
 {
-#if 0
-  tm0 = core.ModeProduct<0>(w);
-#else
-  // tu0
-  // id0: | exp0 | exp1 | ... | expn |
-  // id1: | exp0 | exp1 | ... | expn |
-  // ...
-  // idn: | exp0 | exp1 | ... | expn |
+  const int l = data->layers, m = data->rows;
+  const size_t slot_size = static_cast<size_t>(l) * m * 3;
+  // pad the slots to the alignment of the tensor storage
+  const size_t align = Tensor3::kAlignment / sizeof(double);
+  const size_t slot_stride = (slot_size + align - 1) / align * align;
+  shared_ptr<double> block = TensorFile::Allocate(slot_stride * indices.size());
+
+  vector<MultilinearModel> models(indices.size());
+  for (int k = 0; k < indices.size(); k++) {
+    double *slot = block.get() + k * slot_stride;
+    for (int i = 0; i < l; i++) {
+      GatherColumns(i, indices[k] * 3, 3, slot + i * 3 * m);
+    }
+    models[k].precision = precision;
+    models[k].SetCore(Tensor3::View(block, slot, l, m, 3));
+  }
+
+  return models;
+}
 
-  auto tm0u = tu0.ModeProduct<0>(w);
-  tm0 = Tensor2::FoldByColumn(tm0u, core.rows(), core.cols());
-#endif
+MultilinearModel MultilinearModel::projected(int vidx) const
+{
+  if( !projection_cache ) return project(vector<int>(1, vidx));
+
+  {
+    std::lock_guard<std::mutex> lock(projection_cache->mutex);
+    auto it = projection_cache->models.find(vidx);
+    if( it != projection_cache->models.end() ) return it->second;
+  }
+
+  // project outside the lock, the first of two racing threads wins
+  MultilinearModel model_v = project(vector<int>(1, vidx));
+  std::lock_guard<std::mutex> lock(projection_cache->mutex);
+  projection_cache->models.emplace(vidx, model_v);
+  return model_v;
+}
+
+void MultilinearModel::PreloadProjections(const vector<int> &indices) const
+{
+  if( !projection_cache ) return;
+
+  vector<int> missing;
+  {
+    std::lock_guard<std::mutex> lock(projection_cache->mutex);
+    for(int vidx : indices) {
+      if( projection_cache->models.count(vidx) == 0 ) missing.push_back(vidx);
+    }
+  }
+  std::sort(missing.begin(), missing.end());
+  missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+  if( missing.empty() ) return;
+
+  vector<MultilinearModel> models = projectEach(missing);
+  std::lock_guard<std::mutex> lock(projection_cache->mutex);
+  for (int k = 0; k < missing.size(); k++) {
+    projection_cache->models.emplace(missing[k], std::move(models[k]));
+  }
+}
+
+size_t MultilinearModel::CachedProjections() const
+{
+  if( !projection_cache ) return 0;
+  std::lock_guard<std::mutex> lock(projection_cache->mutex);
+  return projection_cache->models.size();
+}
+
+namespace {
+  bool SameWeights(const Tensor1 &a, const Tensor1 &b) {
+    return a.size() == b.size() && a == b;
+  }
+}
+
+void MultilinearModel::DefineSubset(const string &name, const vector<int> &vertices) const
+{
+  if( !projection_cache ) throw string("Vertex subsets need a model read from a file.");
+  {
+    std::lock_guard<std::mutex> lock(projection_cache->mutex);
+    auto it = projection_cache->subsets.find(name);
+    if( it != projection_cache->subsets.end() && it->second->vertices == vertices ) return;
+  }
+
+  auto subset = make_shared<VertexSubset>();
+  subset->vertices = vertices;
+  subset->model = project(vertices);
+  // evaluations in flight keep the subset they started with
+  std::lock_guard<std::mutex> lock(projection_cache->mutex);
+  projection_cache->subsets[name] = subset;
+}
+
+bool MultilinearModel::HasSubset(const string &name) const
+{
+  if( !projection_cache ) return false;
+  std::lock_guard<std::mutex> lock(projection_cache->mutex);
+  return projection_cache->subsets.count(name) > 0;
+}
+
+void MultilinearModel::ApplyWeightsToSubset(const string &name, const Tensor1 &w0,
+                                            const Tensor1 &w1, Tensor1 &tm) const
+{
+  shared_ptr<const VertexSubset> subset;
+  if( projection_cache ) {
+    std::lock_guard<std::mutex> lock(projection_cache->mutex);
+    auto it = projection_cache->subsets.find(name);
+    if( it != projection_cache->subsets.end() ) subset = it->second;
+  }
+  if( !subset ) throw string("Vertex subset " + name + " is not defined.");
+
+  Tensor2 tm0_s;
+  subset->model.ReducedModeProduct0(w0, tm0_s);
+  tm = tm0_s.ModeProduct<0>(w1);
+}
+
+void MultilinearModel::UpdateTM0(const Tensor1 &w)
+{
+  w0_tm0 = w;
+  tm_applied = false;
+  if( precision != Double ) {
+    ReducedModeProduct0(w, tm0);
+    return;
+  }
+  // a GEMV over the core's mode-0 view writes tm0's column-major layout
+  data->core.ModeProduct<0>(w, tm0);
 }
 
 void MultilinearModel::UpdateTM1(const Tensor1 &w)
 {
-#if 1
-  tm1 = core.ModeProduct<1>(w);
-#else
-  // tu1
-  // exp0: | x0 | y0 | z0 | ..
-  // exp1:
-  // ...
-  // expn:
-  auto tm1u = tu1.ModeProduct<0>(w);
-  tm1 = Tensor2::FoldByRow(tm1u, core.layers(), core.cols());
-#endif
+  w1_tm1 = w;
+  tm1_pending = false;
+  tm_applied = false;
+  ModeProduct1(w, tm1);
+}
+
+void MultilinearModel::ModeProduct1(const Tensor1 &w, Tensor2 &A) const
+{
+  if( precision != Double ) {
+    ReducedModeProduct1(w, A);
+    return;
+  }
+  // a GEMV over the core's mode-1 view writes tm1 in place, transposed
+  data->core.TransposedModeProduct1(w, A);
+}
+
+const Tensor2& MultilinearModel::GetTM1()
+{
+  if( tm1_pending ) {
+    ModeProduct1(w1_tm1, tm1);
+    tm1_pending = false;
+  }
+  return tm1;
 }
 
 void MultilinearModel::UpdateTMWithTM0(const Tensor1 &w)
 {
   tm = tm0.ModeProduct<0>(w);
+  tm_applied = false;
 }
 
 void MultilinearModel::UpdateTMWithTM1(const Tensor1 &w)
 {
-  tm = tm1.ModeProduct<0>(w);
+  GetTM1();
+  tm1.ModeProduct<1>(w, tm);
+  tm_applied = false;
 }
 
 void MultilinearModel::ApplyWeights(const Tensor1 &w0, const Tensor1 &w1)
 {
-  UpdateTM0(w0);
-  UpdateTM1(w1);
-  UpdateTMWithTM0(w1);
+  if( !SameWeights(w0, w0_tm0) ) UpdateTM0(w0);
+  if( !SameWeights(w1, w1_tm1) ) {
+    w1_tm1 = w1;
+    tm1_pending = true;
+    tm_applied = false;
+  }
+  if( !tm_applied ) {
+    tm = tm0.ModeProduct<0>(w1);
+    tm_applied = true;
+  }
+}
+
+void MultilinearModel::ApplyWeights(const Tensor1 &w0, const Tensor1 &w1, Workspace &ws) const
+{
+  ReducedModeProduct0(w0, ws.tm0);
+  ws.tm.resize(data->cols);
+  Map<const MatrixXd> tm0_w(ws.tm0.rawptr(), ws.tm0.rows(), ws.tm0.cols());
+  ws.tm.noalias() = tm0_w.transpose() * w1;
+}
+
+void MultilinearModel::ApplyWeightsBatch(const MatrixXd &W0, const MatrixXd &W1,
+                                         MatrixXd &TM) const
+{
+  const int l = data->layers, m = data->rows, n = data->cols;
+  assert(W0.rows() == l && W1.rows() == m && W0.cols() == W1.cols());
+  const int npairs = W0.cols();
+  TM.resize(n, npairs);
+
+  // group the pairs by identity
+  vector<int> order(npairs);
+  for (int b = 0; b < npairs; b++) order[b] = b;
+  auto column = [&](int b) { return W0.data() + static_cast<size_t>(b) * l; };
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    return std::lexicographical_compare(column(a), column(a) + l, column(b), column(b) + l);
+  });
+  vector<int> group_begin;
+  for (int k = 0; k < npairs; k++) {
+    if( k == 0 || !std::equal(column(order[k]), column(order[k]) + l, column(order[k-1])) )
+      group_begin.push_back(k);
+  }
+  const int ngroups = group_begin.size();
+  group_begin.push_back(npairs);
+
+  // the tm0 of up to 16 identities at a time, each m x n column-major, which
+  // keeps the GEMM efficient in a third of the core's memory at rank 50
+  const size_t tm0_size = static_cast<size_t>(m) * n;
+  const int block = 16;
+  MatrixXd TM0s;
+  for (int g0 = 0; g0 < ngroups; g0 += block) {
+    const int ng = std::min(block, ngroups - g0);
+    MatrixXd W0s(l, ng);
+    for (int g = 0; g < ng; g++) W0s.col(g) = W0.col(order[group_begin[g0 + g]]);
+
+    if( precision == Double ) {
+      TM0s.noalias() = data->core.ModeView0().transpose() * W0s;
+    }
+    else {
+      TM0s.resize(tm0_size, ng);
+      Tensor2 tm0_g;
+      for (int g = 0; g < ng; g++) {
+        ReducedModeProduct0(W0s.col(g), tm0_g);
+        TM0s.col(g) = Map<const VectorXd>(tm0_g.rawptr(), tm0_size);
+      }
+    }
+
+    // tm = tm0^T * w1 for all the expressions of each identity
+    #pragma omp parallel for
+    for (int g = 0; g < ng; g++) {
+      const int k0 = group_begin[g0 + g], nk = group_begin[g0 + g + 1] - k0;
+      Map<const MatrixXd> tm0_g(TM0s.col(g).data(), m, n);
+      MatrixXd W1g(m, nk), TMg(n, nk);
+      for (int k = 0; k < nk; k++) W1g.col(k) = W1.col(order[k0 + k]);
+      TMg.noalias() = tm0_g.transpose() * W1g;
+      for (int k = 0; k < nk; k++) TM.col(order[k0 + k]) = TMg.col(k);
+    }
+  }
 }
 
-void MultilinearModel::UnfoldCoreTensor()
+void MultilinearModel::ResetWeights()
 {
-  tu0 = core.Unfold(0);
-  tu1 = core.Unfold(1);
+  w0_tm0 = Tensor1();
+  w1_tm1 = Tensor1();
+  tm1_pending = false;
+  tm_applied = false;
+}
+
+void MultilinearModel::SetCore(Tensor3 core)
+{
+  auto d = make_shared<CoreData>();
+  d->layers = core.layers(); d->rows = core.rows(); d->cols = core.cols();
+
+  // only the representations used by the current precision are kept. Half
+  // and Int8 drop the double core of models read from a file; projections
+  // are small and already hold dequantized values, they keep the double core.
+  switch( precision ) {
+  case Double: d->core = std::move(core); break;
+  case Mixed: d->core_f = Tensor3f(core); d->core = std::move(core); break;
+  case Half:
+    if( projection_cache ) d->core_h = Tensor3h(core);
+    else d->core = std::move(core);
+    break;
+  case Int8:
+    if( projection_cache ) d->core_i8 = Tensor3i8(core);
+    else d->core = std::move(core);
+    break;
+  }
+  data = d;
+}
+
+void MultilinearModel::GatherColumns(int i, int k0, int nk, double *dst) const
+{
+  const int m = data->rows;
+  if( data->core.size() > 0 ) {
+    const double *src = data->core.layer(i).data() + static_cast<size_t>(k0) * m;
+    std::copy(src, src + static_cast<size_t>(nk) * m, dst);
+  }
+  else if( data->core_h.size() > 0 ) data->core_h.Dequantize(i, k0, nk, dst);
+  else data->core_i8.Dequantize(i, k0, nk, dst);
+}
+
+void MultilinearModel::ReducedModeProduct0(const Tensor1 &w, Tensor2 &A) const
+{
+  if( precision == Mixed ) data->core_f.ModeProduct<0>(w, A);
+  else if( data->core_h.size() > 0 ) data->core_h.ModeProduct<0>(w, A);
+  else if( data->core_i8.size() > 0 ) data->core_i8.ModeProduct<0>(w, A);
+  else data->core.ModeProduct<0>(w, A);
+}
+
+void MultilinearModel::ReducedModeProduct1(const Tensor1 &w, Tensor2 &A) const
+{
+  if( precision == Mixed ) data->core_f.TransposedModeProduct1(w, A);
+  else if( data->core_h.size() > 0 ) data->core_h.TransposedModeProduct1(w, A);
+  else if( data->core_i8.size() > 0 ) data->core_i8.TransposedModeProduct1(w, A);
+  else data->core.TransposedModeProduct1(w, A);
+}
+
+void MultilinearModel::SetPrecision(Precision p)
+{
+  if( p == precision ) return;
+  precision = p;
+  if( data->core.size() > 0 ) {
+    // the new core data shares the storage of the current core, which copies
+    // of the model may still be using, but none of its other representations
+    const Tensor3 &core = data->core;
+    SetCore(Tensor3::View(core.GetStorage(), const_cast<double*>(core.rawptr()),
+                          core.layers(), core.rows(), core.cols()));
+  }
+  else {
+    SetCore(data->core_h.size() > 0?data->core_h.ToDouble():data->core_i8.ToDouble());
+  }
+  // the products were computed at the old precision
+  ResetWeights();
+  // the cached projections and subsets carry the old precision. The subsets
+  // are defined again at the new one, copies of the model keep the old cache.
+  if( projection_cache ) {
+    vector<pair<string, vector<int>>> subsets;
+    {
+      std::lock_guard<std::mutex> lock(projection_cache->mutex);
+      for(auto &s : projection_cache->subsets) subsets.emplace_back(s.first, s.second->vertices);
+    }
+    projection_cache = make_shared<ProjectionCache>();
+    for(auto &s : subsets) DefineSubset(s.first, s.second);
+  }
+}
+
+size_t MultilinearModel::CoreBytes() const
+{
+  return sizeof(double) * data->core.size() + sizeof(float) * data->core_f.size()
+      + data->core_h.bytes() + data->core_i8.bytes();
+}
+
+double MultilinearModel::ReportPrecisionError(const Tensor1 &w0, const Tensor1 &w1,
+                                              const Tensor3 *reference) const
+{
+  const char *names[] = {"double", "mixed", "fp16", "int8"};
+  const Tensor3 &core = reference?*reference:data->core;
+  if( core.size() == 0 ) throw string("No double precision core to compare against.");
+
+  Tensor2 tm0_d = core.ModeProduct<0>(w0), tm0_f;
+  Tensor2 tm1_d, tm1_f;
+  core.TransposedModeProduct1(w1, tm1_d);
+  if( precision == Double ) {
+    // compare against the mixed precision path
+    Tensor3f cf(core);
+    cf.ModeProduct<0>(w0, tm0_f);
+    cf.TransposedModeProduct1(w1, tm1_f);
+  }
+  else {
+    ReducedModeProduct0(w0, tm0_f);
+    ReducedModeProduct1(w1, tm1_f);
+  }
+  Tensor1 tm_d = tm0_d.ModeProduct<0>(w1), tm_f = tm0_f.ModeProduct<0>(w1);
+
+  auto report = [](const string &name, const MatrixXd &ref, const MatrixXd &val) {
+    double max_err = (val - ref).cwiseAbs().maxCoeff();
+    double rel_err = (val - ref).norm() / ref.norm();
+    cout << name << ": max abs error = " << max_err
+         << ", relative error = " << rel_err << endl;
+    return rel_err;
+  };
+
+  cout << names[(precision == Double)?Mixed:precision]
+       << " precision vs double precision:" << endl;
+  report("tm0", tm0_d.GetData(), tm0_f.GetData());
+  report("tm1", tm1_d.GetData(), tm1_f.GetData());
+  return report("tm", tm_d, tm_f);
 }
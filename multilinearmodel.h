@@ -4,35 +4,333 @@
 #include "tensor.hpp"
 #include "utils.hpp"
 
+#include <map>
+#include <mutex>
+
+// Copies of a model share its core and the unfoldings or reduced precision
+// copies built from it, which never change once built. Each copy has its own
+// weights and results (tm0, tm1, tm).
 class MultilinearModel
 {
 public:
-  MultilinearModel(){}
+  // Double keeps everything in double precision. Mixed evaluates the mode
+  // products on a single precision copy of the core and accumulates in double,
+  // which halves the memory traffic of ApplyWeights. Half and Int8 store the
+  // core with 16 or 8 bits per element and a scale/offset per (identity,
+  // expression) slice, dequantized inside the mode products. Half and Int8
+  // models read from a file keep only the quantized core; their projections
+  // gather the dequantized columns and evaluate on them in double precision.
+  enum Precision { Double, Mixed, Half, Int8 };
+
+  MultilinearModel();
   explicit MultilinearModel(const string &filename);
 
+  // The model of a file, read once per process: all the models returned for
+  // the same file share one core and one projection cache, for as long as
+  // any of them is alive.
+  static MultilinearModel Shared(const string &filename);
+
   MultilinearModel project(const vector<int> &indices) const;
 
+  // One single-vertex model per index, as project(vector<int>(1, index)),
+  // gathered in one pass. The cores of all the returned models live in one
+  // landmark-major block: the l x m x 3 core of indices[k] is the k-th slot
+  // of the block, each slot 64-byte aligned.
+  vector<MultilinearModel> projectEach(const vector<int> &indices) const;
+
+  // project(vector<int>(1, vidx)) through a cache of the single-vertex models
+  // of this model, shared by all copies of it and safe to use from several
+  // threads. Vertices are projected the first time they are asked for, or
+  // ahead of time with PreloadProjections.
+  MultilinearModel projected(int vidx) const;
+  void PreloadProjections(const vector<int> &indices) const;
+  size_t CachedProjections() const;
+
+  // Named vertex subsets, e.g. the face region or the contour candidates.
+  // DefineSubset gathers the sub-core of the vertices once, and the subset is
+  // shared by all copies of the model like the projections; defining a name
+  // again with other vertices replaces it. ApplyWeightsToSubset evaluates
+  // only the coordinates of the subset's vertices, in the order they were
+  // given, into tm. Only models read from a file have subsets; SetPrecision
+  // defines them again at the new precision.
+  void DefineSubset(const string &name, const vector<int> &vertices) const;
+  bool HasSubset(const string &name) const;
+  void ApplyWeightsToSubset(const string &name, const Tensor1 &w0, const Tensor1 &w1,
+                            Tensor1 &tm) const;
+
   void UpdateTM0(const Tensor1 &w);
   void UpdateTM1(const Tensor1 &w);
   void UpdateTMWithTM0(const Tensor1 &w);
   void UpdateTMWithTM1(const Tensor1 &w);
+
+  // tm0 = core x_0 w0 and tm = tm0 x_0 w1. Only the products whose weights
+  // changed since the last call are recomputed. tm1 = core x_1 w1 is left
+  // pending until GetTM1 asks for it.
   void ApplyWeights(const Tensor1 &w0, const Tensor1 &w1);
 
+  // Scratch results of a const evaluation, owned by the caller, one per
+  // thread. They keep their allocations from one evaluation to the next.
+  struct Workspace {
+    Tensor2 tm0;
+    Tensor1 tm;
+  };
+
+  // ws.tm0 = core x_0 w0 and ws.tm = ws.tm0 x_0 w1, without touching the
+  // model, which can be evaluated from several threads at once
+  void ApplyWeights(const Tensor1 &w0, const Tensor1 &w1, Workspace &ws) const;
+
+  // The tm of many weight pairs: column b of TM is the geometry for identity
+  // W0.col(b) and expression W1.col(b). Pairs sharing an identity share its
+  // tm0, and the tm0 of distinct identities come from one GEMM on the core.
+  // The model's own tm0, tm1 and tm are left untouched.
+  void ApplyWeightsBatch(const MatrixXd &W0, const MatrixXd &W1, MatrixXd &TM) const;
+
   const Tensor1& GetTM() const {
     return tm;
   }
 
   const Tensor2& GetTM0() const { return tm0; }
-  const Tensor2& GetTM1() const { return tm1; }
+  // tm1 is kept transposed, cols x layers, which is the layout the GEMV over
+  // the core's mode-1 view produces. It is computed here when ApplyWeights
+  // left it pending, so it is only available on a non-const model.
+  const Tensor2& GetTM1();
+  // The double precision core, empty for Half and Int8 models read from a file
+  const Tensor3& GetCore() const { return data->core; }
+
+  // Switching a Half or Int8 model read from a file back to a higher precision
+  // dequantizes its core, the digits dropped by the quantization are lost.
+  void SetPrecision(Precision p);
+  Precision GetPrecision() const { return precision; }
+
+  // Bytes held by the core in all the representations the model keeps, i.e.
+  // what the model adds to the resident size of the process. Copies of the
+  // model share these bytes, each of them reports them.
+  size_t CoreBytes() const;
+
+  // Prints the error of the reduced precision path (mixed if the model is in
+  // double precision) against the double precision one for the given weights,
+  // returns the relative error of tm. Models without a double precision core
+  // are compared against the given reference core.
+  double ReportPrecisionError(const Tensor1 &w0, const Tensor1 &w1,
+                              const Tensor3 *reference = nullptr) const;
 private:
-  void UnfoldCoreTensor();
+  void SetCore(Tensor3 core);
+  void GatherColumns(int i, int k0, int nk, double *dst) const;
+  void ReducedModeProduct0(const Tensor1 &w, Tensor2 &A) const;
+  void ReducedModeProduct1(const Tensor1 &w, Tensor2 &A) const;
+  void ModeProduct1(const Tensor1 &w, Tensor2 &A) const;
+  void ResetWeights();
 
 private:
-  Tensor3 core;
-  Tensor2 tu0, tu1;     // unfolded tensor in 0, 1 dimension
+  struct ProjectionCache;
+  struct VertexSubset;
+
+  // The mode-0 and mode-1 unfoldings of the core are the views
+  // core.ModeView0() and core.ModeView1() of its single buffer, so double
+  // precision keeps nothing besides the core. Half and Int8 models read from a
+  // file leave core empty.
+  struct CoreData {
+    int layers = 0, rows = 0, cols = 0;
+    Tensor3 core;
+    Tensor3f core_f;      // single precision core, Mixed only
+    Tensor3h core_h;      // fp16 core, Half only
+    Tensor3i8 core_i8;    // int8 core, Int8 only
+  };
+
+  Precision precision;
+  shared_ptr<const CoreData> data;
 
-  Tensor2 tm0, tm1;  // tensor after mode product
-  Tensor1 tm;        // tensor after 2 mode product
+  Tensor2 tm0;           // tensor after mode product
+  Tensor2 tm1;           // transposed, see GetTM1
+  Tensor1 tm;            // tensor after 2 mode product
+
+  // the weights tm0 and tm1 were computed with, tm1 may still be pending
+  Tensor1 w0_tm0;
+  Tensor1 w1_tm1;
+  bool tm1_pending = false;
+  bool tm_applied = false;  // tm = tm0 x_0 w1_tm1
+
+  // projected single-vertex models and vertex subsets, only for models read
+  // from a file
+  shared_ptr<ProjectionCache> projection_cache;
+};
+
+// The results of a MultilinearModel (tm0, tm1 and tm) in matrices whose
+// dimensions are template parameters, with the const evaluations that only
+// read them. This is all the cost functions need of their landmark, so they
+// hold one of these instead of a copy of the landmark's core. Any dimension
+// can be Dynamic, which gives the fallback for models of arbitrary rank.
+template <int NId, int NExp, int NCoords>
+class FixedModelResults
+{
+public:
+  using TM0Matrix = Matrix<double, NExp, NCoords>;
+  using TM1Matrix = Matrix<double, NCoords, NId>;
+  using TMVector = Matrix<double, NCoords, 1>;
+  using FACSMatrix = Matrix<double, NCoords, Dynamic>;
+
+  FixedModelResults(){}
+
+  // Copies the current tm0 and tm of model. Only the identity evaluations
+  // read tm1, they copy it with CopyTM1.
+  explicit FixedModelResults(const MultilinearModel &model) {
+    const Tensor3 &c = model.GetCore();
+    if( (NId != Dynamic && c.layers() != NId)
+        || (NExp != Dynamic && c.rows() != NExp)
+        || (NCoords != Dynamic && c.cols() != NCoords) ) {
+      throw "Model dimensions do not match the fixed dimensions <"
+          + to_string(NId) + ", " + to_string(NExp) + ", " + to_string(NCoords) + ">";
+    }
+    nid = c.layers(); nexp = c.rows(); ncoords = c.cols();
+
+    tm0.setZero(nexp, ncoords);
+    tm1.setZero(ncoords, nid);
+    tm.setZero(ncoords);
+    if( model.GetTM0().rows() == nexp ) tm0 = model.GetTM0().GetData();
+    if( model.GetTM().size() == ncoords ) tm = model.GetTM();
+  }
+
+  // Copies the current tm1 of model, which the model computes on demand
+  void CopyTM1(MultilinearModel &model) {
+    if( model.GetTM1().cols() == nid ) tm1 = model.GetTM1().GetData();
+  }
+
+  // w may be a row or a column vector
+  template <typename Derived>
+  void UpdateTMWithTM0(const MatrixBase<Derived> &w) { EvaluateWithTM0(w, tm); }
+
+  template <typename Derived>
+  void UpdateTMWithTM1(const MatrixBase<Derived> &w) { EvaluateWithTM1(w, tm); }
+
+  // The same products into a tm owned by the caller. They leave the model
+  // untouched, so one model can be evaluated from several threads, e.g. by
+  // the cost functions under a multithreaded solver.
+  template <typename Derived>
+  void EvaluateWithTM0(const MatrixBase<Derived> &w, TMVector &tm_out) const {
+    Matrix<double, NExp, 1> wv = w;
+    tm_out.noalias() = tm0.transpose() * wv;
+  }
+
+  template <typename Derived>
+  void EvaluateWithTM1(const MatrixBase<Derived> &w, TMVector &tm_out) const {
+    Matrix<double, NId, 1> wv = w;
+    tm_out.noalias() = tm1 * wv;
+  }
+
+  // The expression products in FACS coordinates. The FACS weights of the
+  // expression solves are f = (1 - sum(x), x), and the expression weights
+  // are Uexp^T f, so
+  //   tm = tm0^T Uexp^T f = facs_tm + facs_basis * x
+  // SetFACSBasis folds Uexp and the neutral weight into the current tm0
+  // once; EvaluateFACS is then a single ncoords x (nfacs - 1) product, which
+  // is also the Jacobian of tm with respect to x.
+  void SetFACSBasis(const MatrixXd &Uexp) {
+    assert(Uexp.cols() == nexp);
+    Matrix<double, Dynamic, NCoords> F = Uexp * tm0;
+    facs_tm = F.row(0).transpose();
+    facs_basis = (F.bottomRows(F.rows() - 1).rowwise() - F.row(0)).transpose();
+  }
+
+  template <typename Derived>
+  void EvaluateFACS(const MatrixBase<Derived> &x, TMVector &tm_out) const {
+    tm_out = facs_tm;
+    tm_out.noalias() += facs_basis * x;
+  }
+
+  const FACSMatrix& GetFACSBasis() const { return facs_basis; }
+
+  const TMVector& GetTM() const { return tm; }
+  const TM0Matrix& GetTM0() const { return tm0; }
+  const TM1Matrix& GetTM1() const { return tm1; }
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+private:
+  int nid = NId, nexp = NExp, ncoords = NCoords;
+  TM0Matrix tm0;      // NExp x NCoords, core x_0 w0
+  TM1Matrix tm1;      // NCoords x NId, (core x_1 w1)^T as in MultilinearModel
+  TMVector tm;
+  TMVector facs_tm;       // tm of the neutral expression, see SetFACSBasis
+  FACSMatrix facs_basis;  // NCoords x (nfacs - 1)
+};
+
+// The results of a single-vertex model as used by the cost functions. Models
+// whose core has the ranks NId x NExp evaluate on fixed-size results; any
+// other rank, e.g. a model built with other truncation ranks, falls back to
+// dynamic ones. The choice is made once, from the ranks of the model.
+template <int NId, int NExp>
+class LandmarkResults
+{
+public:
+  using FixedResults = FixedModelResults<NId, NExp, 3>;
+  using DynamicResults = FixedModelResults<Dynamic, Dynamic, 3>;
+  using TMVector = Matrix<double, 3, 1>;
+  using FACSMatrix = Matrix<double, 3, Dynamic>;
+  using ResultRef = Ref<const Matrix<double, Dynamic, 3>>;
+  using TM1Ref = Ref<const Matrix<double, 3, Dynamic>>;
+
+  LandmarkResults(){}
+
+  explicit LandmarkResults(const MultilinearModel &model) {
+    const Tensor3 &c = model.GetCore();
+    fixed_size = (c.layers() == NId && c.rows() == NExp);
+    if( fixed_size ) fixed = FixedResults(model);
+    else dynamic = DynamicResults(model);
+  }
+
+  bool IsFixedSize() const { return fixed_size; }
+
+  void CopyTM1(MultilinearModel &model) {
+    if( fixed_size ) fixed.CopyTM1(model); else dynamic.CopyTM1(model);
+  }
+
+  template <typename Derived>
+  void UpdateTMWithTM0(const MatrixBase<Derived> &w) {
+    if( fixed_size ) fixed.UpdateTMWithTM0(w); else dynamic.UpdateTMWithTM0(w);
+  }
+
+  template <typename Derived>
+  void UpdateTMWithTM1(const MatrixBase<Derived> &w) {
+    if( fixed_size ) fixed.UpdateTMWithTM1(w); else dynamic.UpdateTMWithTM1(w);
+  }
+
+  template <typename Derived>
+  void EvaluateWithTM0(const MatrixBase<Derived> &w, TMVector &tm_out) const {
+    if( fixed_size ) fixed.EvaluateWithTM0(w, tm_out); else dynamic.EvaluateWithTM0(w, tm_out);
+  }
+
+  template <typename Derived>
+  void EvaluateWithTM1(const MatrixBase<Derived> &w, TMVector &tm_out) const {
+    if( fixed_size ) fixed.EvaluateWithTM1(w, tm_out); else dynamic.EvaluateWithTM1(w, tm_out);
+  }
+
+  void SetFACSBasis(const MatrixXd &Uexp) {
+    if( fixed_size ) fixed.SetFACSBasis(Uexp); else dynamic.SetFACSBasis(Uexp);
+  }
+
+  template <typename Derived>
+  void EvaluateFACS(const MatrixBase<Derived> &x, TMVector &tm_out) const {
+    if( fixed_size ) fixed.EvaluateFACS(x, tm_out); else dynamic.EvaluateFACS(x, tm_out);
+  }
+
+  const FACSMatrix& GetFACSBasis() const {
+    return fixed_size?fixed.GetFACSBasis():dynamic.GetFACSBasis();
+  }
+
+  const TMVector& GetTM() const { return fixed_size?fixed.GetTM():dynamic.GetTM(); }
+  ResultRef GetTM0() const {
+    return fixed_size?ResultRef(fixed.GetTM0()):ResultRef(dynamic.GetTM0());
+  }
+  TM1Ref GetTM1() const {
+    return fixed_size?TM1Ref(fixed.GetTM1()):TM1Ref(dynamic.GetTM1());
+  }
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+private:
+  bool fixed_size = false;
+  FixedResults fixed;
+  DynamicResults dynamic;
 };
 
 struct MultilinearModelPrior {
@@ -48,10 +346,44 @@ struct MultilinearModelPrior {
 
   double weight_Wid, weight_Wexp;
 
+  // The priors of a pair of files, read once per process and shared read-only
+  // for as long as any user holds them. Callers that adjust Wid0 or the
+  // weights keep a copy; it is only a few small matrices.
+  static shared_ptr<const MultilinearModelPrior> Shared(const string &filename_id,
+                                                        const string &filename_exp) {
+    static std::mutex mutex;
+    static std::map<pair<string, string>, std::weak_ptr<const MultilinearModelPrior>> registry;
+
+    const auto key = make_pair(filename_id, filename_exp);
+    auto lookup = [&]() {
+      shared_ptr<const MultilinearModelPrior> prior;
+      auto it = registry.find(key);
+      if( it != registry.end() ) {
+        prior = it->second.lock();
+        if( !prior ) registry.erase(it);
+      }
+      return prior;
+    };
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if( auto prior = lookup() ) return prior;
+    }
+
+    // loaded outside the lock, the first of two racing threads is published
+    auto loaded = make_shared<MultilinearModelPrior>();
+    loaded->load(filename_id, filename_exp);
+    std::lock_guard<std::mutex> lock(mutex);
+    if( auto prior = lookup() ) return prior;
+    registry[key] = loaded;
+    return loaded;
+  }
+
   void load(const string &filename_id, const string &filename_exp) {
     cout << "loading prior data ..." << endl;
+    // the prior files may be plain or wrapped in a compressed tensor file
     const string fnwid = filename_id;
-    ifstream fwid(fnwid, ios::in | ios::binary);
+    istringstream fwid(TensorFile::ReadBytes(fnwid));
 
     int ndims;
     fwid.read(reinterpret_cast<char*>(&ndims), sizeof(int));
@@ -79,7 +411,6 @@ struct MultilinearModelPrior {
     Uid.resize(m, n);
     fwid.read(reinterpret_cast<char*>(Uid.data()), sizeof(double)*m*n);
 
-    fwid.close();
 
     message("identity prior loaded.");
     /*
@@ -101,7 +432,7 @@ struct MultilinearModelPrior {
     message("done");
 
     const string fnwexp = filename_exp;
-    ifstream fwexp(fnwexp, ios::in | ios::binary);
+    istringstream fwexp(TensorFile::ReadBytes(fnwexp));
 
     fwexp.read(reinterpret_cast<char*>(&ndims), sizeof(int));
     cout << "expression prior dim = " << ndims << endl;
@@ -127,7 +458,6 @@ struct MultilinearModelPrior {
     Uexp.resize(m, n);
     fwexp.read(reinterpret_cast<char*>(Uexp.data()), sizeof(double)*m*n);
 
-    fwexp.close();
 
     message("expression prior loaded.");
     /*
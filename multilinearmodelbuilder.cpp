@@ -1,7 +1,23 @@
 #include "multilinearmodelbuilder.h"
 
 int main(int argc, char** argv) {
-  MultilinearModelBuilder builder;
+  // usage: multilinearmodelbuilder [--compress] [identity_rank expression_rank [hooi_iters [memory_budget_mb]]]
+  bool compress = false;
+  if( argc >= 2 && string(argv[1]) == "--compress" ) {
+    compress = true;
+    --argc; ++argv;
+  }
+
+  int nIdRank = 50, nExpRank = 25, hooi_iters = 0;
+  size_t memory_budget = 0;
+  if( argc >= 3 ) {
+    nIdRank = atoi(argv[1]);
+    nExpRank = atoi(argv[2]);
+  }
+  if( argc >= 4 ) hooi_iters = atoi(argv[3]);
+  if( argc >= 5 ) memory_budget = static_cast<size_t>(atol(argv[4])) << 20;
+
+  MultilinearModelBuilder builder(nIdRank, nExpRank, hooi_iters, memory_budget, compress);
   builder.build();
   return 0;
 }
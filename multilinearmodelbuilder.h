@@ -2,34 +2,35 @@
 #define MULTILINEARMODELBUILDER_H
 
 #include "blendshape_data.h"
+#include "streaminghosvd.h"
 #include "tensor.hpp"
 #include "utils.hpp"
 
 class MultilinearModelBuilder {
 public:
-  MultilinearModelBuilder(){}
+  // hooi_iters > 0 refines the truncated HOSVD with that many HOOI sweeps at
+  // most, which reaches the same error at lower ranks.
+  // memory_budget > 0 streams the blend shapes from disk one identity at a
+  // time instead of assembling the whole tensor, using about that many bytes.
+  // compress writes the core and factor files in the compressed container.
+  MultilinearModelBuilder(int nIdRank = 50, int nExpRank = 25, int hooi_iters = 0,
+                          size_t memory_budget = 0, bool compress = false)
+    : nIdRank(nIdRank), nExpRank(nExpRank), hooi_iters(hooi_iters),
+      memory_budget(memory_budget), compress(compress) {}
   void build(){
+    if( memory_budget > 0 ) {
+      buildStreaming();
+      return;
+    }
+
     cout << "building multilinear model ..." << endl;
 
     vector<BlendShape> shapes;
 
-    const int nShapes = 150;			// 150 identity
-    const int nExprs = 47;				// 46 expressions + 1 neutral
-    const int nVerts = 11510;			// 11510 vertices for each mesh
-
-    const string path = "/home/phg/Data/FaceWarehouse_Data_0/";
-    const string foldername = "Tester_";
-    const string bsfolder = "Blendshape";
-    const string filename = "shape.bs";
-
     shapes.resize(nShapes);
     for(int i=0;i<nShapes;i++) {
-      stringstream ss;
-      ss << path << foldername << (i+1) << "/" << bsfolder + "/" + filename;
-
-      shapes[i].read(ss.str());
+      shapes[i].read(shapeFilename(i));
     }
-    int nCoords = nVerts * 3;
 
     // create an order 3 tensor for the blend shapes
     Tensor3 t(nShapes, nExprs, nCoords);
@@ -74,20 +75,17 @@ public:
     // perform svd to get core tensor
     cout << "Performing SVD on the blendshapes ..." << endl;
     int ms[2] = {0, 1};		// only the first two modes
-    int ds[2] = {50, 25};	// pick 50 for identity and 25 for expression
+    int ds[2] = {nIdRank, nExpRank};	// 50 for identity and 25 for expression by default
     vector<int> modes(ms, ms+2);
     vector<int> dims(ds, ds+2);
-    auto comp2 = t.svd(modes, dims);
+    // both mode dimensions are small, so Auto picks the exact Gram solver
+    auto comp2 = (hooi_iters > 0)?t.hooi(modes, dims, hooi_iters, 1e-6, Tensor3::Auto)
+                                 :t.svd(modes, dims, Tensor3::Auto);
     cout << "SVD done." << endl;
 
     auto tcore = std::get<0>(comp2);
     auto tus = std::get<1>(comp2);
-    cout << "writing core tensor ..." << endl;
-    tcore.Write("blendshape_core.tensor");
-    cout << "writing U tensors ..." << endl;
-    for(int i=0;i<tus.size();i++) {
-      tus[i].Write("blendshape_u_" + std::to_string(ms[i]) + ".tensor");
-    }
+    writeModel(tcore, tus);
 
     cout << "Validation begins ..." << endl;
     Tensor3 tin;
@@ -109,7 +107,7 @@ public:
     }
     cout << "Max difference io = " << maxDiffio << endl;
 
-    tin = tin.ModeProduct(tus[0], 0).ModeProduct(tus[1], 1);
+    tin = ModeProductChain(tin).ModeProduct(tus[0], 0).ModeProduct(tus[1], 1).Eval();
 
     cout << "Dimensions = "
       << tin.layers() << "x"
@@ -129,6 +127,94 @@ public:
     cout << "done" << endl;
 
   }
+
+  // Out-of-core build: peak memory is bounded by the budget plus the core
+  void buildStreaming() {
+    cout << "building multilinear model out of core with "
+         << memory_budget / 1048576 << " MB ..." << endl;
+    if( hooi_iters > 0 ) cout << "HOOI is not applied in streaming mode." << endl;
+
+    // the deformation map is filled while the Gram matrices are accumulated,
+    // each row on the first load of its identity; the first Gram pass
+    // streams every identity
+    Tensor2 distmap(nShapes, nVerts);
+    vector<bool> distmap_done(nShapes, false);
+    auto loader = [&](int i, MatrixXd &S) {
+      BlendShape bs;
+      bs.read(shapeFilename(i));
+      S.resize(nExprs, nCoords);
+      for(int j=0;j<bs.expressionCount();j++) {
+        const BlendShape::shape_t& bsij = bs.expression(j);
+        for(int k=0, cidx = 0;k<nVerts;k++, cidx+=3) {
+          const BlendShape::vert_t& v = bsij[k];
+          S(j, cidx) = v.x;
+          S(j, cidx+1) = v.y;
+          S(j, cidx+2) = v.z;
+        }
+      }
+
+      if( distmap_done[i] ) return;
+      distmap_done[i] = true;
+      const BlendShape::shape_t& bsi0 = bs.expression(0);
+      for(int k=0;k<nVerts;k++) distmap(i, k) = 0;
+      for(int j=1;j<bs.expressionCount();j++) {
+        const BlendShape::shape_t& bsij = bs.expression(j);
+        for(int k=0;k<nVerts;k++) {
+          const BlendShape::vert_t& v0 = bsi0[k];
+          const BlendShape::vert_t& v = bsij[k];
+          float dx = v.x - v0.x, dy = v.y - v0.y, dz = v.z - v0.z;
+          distmap(i, k) += sqrt(dx*dx+dy*dy+dz*dz);
+        }
+      }
+    };
+
+    StreamingHOSVD hosvd(nShapes, nExprs, nCoords, loader, memory_budget);
+    auto comp2 = hosvd.Compute(nIdRank, nExpRank);
+    distmap.Write("distmap.txt");
+
+    auto tcore = std::get<0>(comp2);
+    auto tus = std::get<1>(comp2);
+    writeModel(tcore, tus);
+
+    cout << "Validation begins ..." << endl;
+    cout << "Max difference = " << hosvd.MaxReconstructionError(tcore, tus) << endl;
+    cout << "done" << endl;
+  }
+
+private:
+  // The factors are those of modes 0 and 1
+  void writeModel(Tensor3 &tcore, vector<Tensor2> &tus) {
+    cout << "writing core tensor ..." << endl;
+    if( compress ) tcore.WriteCompressed("blendshape_core.tensor");
+    else tcore.Write("blendshape_core.tensor");
+    cout << "writing U tensors ..." << endl;
+    for(int i=0;i<tus.size();i++) {
+      const string filename = "blendshape_u_" + std::to_string(i) + ".tensor";
+      if( compress ) tus[i].WriteCompressed(filename);
+      else tus[i].Write(filename);
+    }
+  }
+
+  static string shapeFilename(int i) {
+    const string path = "/home/phg/Data/FaceWarehouse_Data_0/";
+    const string foldername = "Tester_";
+    const string bsfolder = "Blendshape";
+    const string filename = "shape.bs";
+
+    stringstream ss;
+    ss << path << foldername << (i+1) << "/" << bsfolder + "/" + filename;
+    return ss.str();
+  }
+
+  static const int nShapes = 150;			// 150 identity
+  static const int nExprs = 47;				// 46 expressions + 1 neutral
+  static const int nVerts = 11510;			// 11510 vertices for each mesh
+  static const int nCoords = nVerts * 3;
+
+  int nIdRank, nExpRank;
+  int hooi_iters;
+  size_t memory_budget;
+  bool compress;
 };
 
 #endif // MULTILINEARMODELBUILDER_H
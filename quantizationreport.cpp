@@ -0,0 +1,88 @@
+#include "multilinearmodel.h"
+
+#include <random>
+
+// Reports the memory and the worst-case vertex error of the reduced precision
+// core representations against the double precision model.
+//
+// Usage: QuantizationReport core.tensor [u0.tensor u1.tensor]
+//
+// With the identity/expression factors of the decomposition, the error is
+// measured over every identity/expression pair of the training data. Without
+// them, random unit weight pairs are used.
+namespace {
+  // Largest distance between corresponding vertices of two meshes
+  double MaxVertexError(const Tensor1 &a, const Tensor1 &b) {
+    double e = 0;
+    for(int v=0;v+2<a.size();v+=3) {
+      e = std::max(e, (a.segment<3>(v) - b.segment<3>(v)).norm());
+    }
+    return e;
+  }
+}
+
+int main(int argc, char **argv) {
+  if( argc < 2 ) {
+    cout << "Usage: " << argv[0] << " core.tensor [u0.tensor u1.tensor]" << endl;
+    return -1;
+  }
+
+  MultilinearModel model_ref(argv[1]);
+  const Tensor3 &core = model_ref.GetCore();
+  const int nid = core.layers(), nexp = core.rows();
+
+  // weight pairs, one row per sample
+  MatrixXd W0, W1;
+  if( argc >= 4 ) {
+    Tensor2 u0, u1;
+    if( !u0.Read(argv[2]) || !u1.Read(argv[3]) ) return -1;
+    W0 = u0.GetData();
+    W1 = u1.GetData();
+  }
+  else {
+    std::mt19937 gen(0);
+    std::normal_distribution<double> normal;
+    W0.resize(16, nid);
+    W1.resize(16, nexp);
+    for(int i=0;i<W0.size();++i) W0.data()[i] = normal(gen);
+    for(int i=0;i<W1.size();++i) W1.data()[i] = normal(gen);
+    W0.rowwise().normalize();
+    W1.rowwise().normalize();
+  }
+
+  const size_t core_bytes = sizeof(double) * core.size();
+  cout << "double: core " << core_bytes / 1048576.0 << " MB" << endl;
+
+  const MultilinearModel::Precision precisions[] = {
+    MultilinearModel::Mixed, MultilinearModel::Half, MultilinearModel::Int8
+  };
+  const char *names[] = {"mixed", "fp16", "int8"};
+
+  for(int p=0;p<3;++p) {
+    MultilinearModel model(argv[1]);
+    model.SetPrecision(precisions[p]);
+
+    double max_err = 0, sum_err = 0;
+    int worst_id = 0, worst_exp = 0;
+    for(int i=0;i<W0.rows();++i) {
+      Tensor1 w0 = W0.row(i).transpose();
+      model_ref.UpdateTM0(w0);
+      model.UpdateTM0(w0);
+      for(int j=0;j<W1.rows();++j) {
+        Tensor1 w1 = W1.row(j).transpose();
+        model_ref.UpdateTMWithTM0(w1);
+        model.UpdateTMWithTM0(w1);
+        double e = MaxVertexError(model.GetTM(), model_ref.GetTM());
+        sum_err += e;
+        if( e > max_err ) { max_err = e; worst_id = i; worst_exp = j; }
+      }
+    }
+
+    cout << names[p] << ": core " << model.CoreBytes() / 1048576.0
+         << " MB, worst vertex error " << max_err
+         << " (identity " << worst_id << ", expression " << worst_exp << ")"
+         << ", mean of per-mesh worst " << sum_err / (W0.rows() * W1.rows()) << endl;
+  }
+
+  return 0;
+}
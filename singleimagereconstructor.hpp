@@ -51,10 +51,14 @@ public:
   SingleImageReconstructor()
     : opt_mode(All), need_precise_result(false), is_parameters_initialized(false), display_step_result(false) {}
 
-  void LoadModel(const string &filename) { model = MultilinearModel(filename); }
+  // The model and the priors are shared with every other reconstructor in
+  // the process that uses the same files
+  void LoadModel(const string &filename) { model = MultilinearModel::Shared(filename); }
+  // Shares the core and the projected vertex cache of the given model
+  void SetModel(const MultilinearModel &model_in) { model = model_in; }
 
   void LoadPriors(const string &filename_id, const string &filename_exp) {
-    prior.load(filename_id, filename_exp);
+    prior = *MultilinearModelPrior::Shared(filename_id, filename_exp);
   }
 
   void SetContourIndices(
@@ -249,10 +253,18 @@ void SingleImageReconstructor<Constraint>::UpdateModels() {
     params_recon.cons[i].weight = 1.0;
   }
 
+  // Project the landmarks and all contour candidates once, the contour
+  // updates then only copy them from the cache
+  vector<int> candidates(indices.begin(), indices.end());
+  for (auto &contour : contour_indices) {
+    candidates.insert(candidates.end(), contour.begin(), contour.end());
+  }
+  model.PreloadProjections(candidates);
+
   // Create initial projected models
   model_projected.resize(params_recon.cons.size());
   for (size_t i = 0; i < params_recon.cons.size(); ++i) {
-    model_projected[i] = model.project(vector<int>(1, indices[i]));
+    model_projected[i] = model.projected(indices[i]);
     model_projected[i].ApplyWeights(params_model.Wid, params_model.Wexp);
   }
 }
@@ -1313,7 +1325,7 @@ void SingleImageReconstructor<Constraint>::UpdateContourIndices(int iterations)
       //cout << i << ": " << indices[i] << " -> " << candidates[min_iter - dists.begin()].first << endl;
       indices[i] = (*candidates)[min_iter - dists.begin()].first;
       params_recon.cons[i].vidx = (*candidates)[min_iter - dists.begin()].first;
-      model_projected[i] = model.project(vector<int>(1, indices[i]));
+      model_projected[i] = model.projected(indices[i]);
       model_projected[i].ApplyWeights(params_model.Wid, params_model.Wexp);
     }
   }
@@ -0,0 +1,131 @@
+#ifndef STREAMINGHOSVD_H
+#define STREAMINGHOSVD_H
+
+#include "tensor.hpp"
+
+#include <functional>
+
+// Truncated HOSVD over modes 0 and 1 of an nids x nexprs x ncoords tensor that
+// is never held in memory as a whole. The tensor is read one identity slice at
+// a time through a loader:
+//
+//   pass 1..k  accumulate the mode-0 Gram matrix X0 X0^T block by block, the
+//              mode-1 Gram matrix sum_i T_i T_i^T during the first pass
+//   pass k+1   core = sum_i U0(i, :) (x) (U1^T T_i)
+//
+// Identity slices are cached in blocks that fit in the memory budget, so the
+// number of Gram passes is about nids * slice size / budget. With a budget
+// that holds every slice, the Gram matrices take a single pass.
+class StreamingHOSVD {
+public:
+  // Loads identity i as an nexprs x ncoords matrix, S(j, k) = T(i, j, k)
+  using SliceLoader = std::function<void(int, MatrixXd&)>;
+
+  StreamingHOSVD(int nids, int nexprs, int ncoords,
+                 const SliceLoader &loader, size_t memory_budget)
+    : nids(nids), nexprs(nexprs), ncoords(ncoords),
+      loader(loader), memory_budget(memory_budget) {}
+
+  tuple<Tensor3, vector<Tensor2>> Compute(int id_rank, int exp_rank) const {
+    assert(id_rank <= nids && exp_rank <= nexprs);
+
+    MatrixXd G0, G1;
+    ComputeGramMatrices(id_rank, exp_rank, G0, G1);
+
+    MatrixXd U0 = LeadingEigenvectors(G0, id_rank);
+    MatrixXd U1 = LeadingEigenvectors(G1, exp_rank);
+
+    cout << "projecting identities into the core ..." << endl;
+    Tensor3 core(id_rank, exp_rank, ncoords);
+    core.Flatten().setZero();
+    MatrixXd S, P;
+    for(int i=0;i<nids;++i) {
+      loader(i, S);
+      P.noalias() = U1.transpose() * S;
+      #pragma omp parallel for
+      for(int a=0;a<id_rank;++a) {
+        core.layer(a).noalias() += U0(i, a) * P;
+      }
+    }
+    cout << "done." << endl;
+
+    return make_tuple(core, vector<Tensor2>{Tensor2(U0), Tensor2(U1)});
+  }
+
+  // Largest element-wise difference between the tensor and its reconstruction
+  // from a decomposition returned by Compute, in one more pass.
+  double MaxReconstructionError(const Tensor3 &core, const vector<Tensor2> &tus) const {
+    const MatrixXd &U0 = tus[0].GetData(), &U1 = tus[1].GetData();
+    double max_err = 0;
+    MatrixXd S, C(core.rows(), core.cols());
+    for(int i=0;i<nids;++i) {
+      loader(i, S);
+      C.setZero();
+      for(int a=0;a<core.layers();++a) C.noalias() += U0(i, a) * core.layer(a);
+      max_err = std::max(max_err, (U1 * C - S).cwiseAbs().maxCoeff());
+    }
+    return max_err;
+  }
+
+private:
+  size_t SliceBytes() const {
+    return sizeof(double) * static_cast<size_t>(nexprs) * ncoords;
+  }
+
+  // Number of identity slices cached per Gram pass
+  int BlockSize(int id_rank, int exp_rank) const {
+    // the core, the slice being streamed and the projection stay resident
+    size_t fixed = sizeof(double) * static_cast<size_t>(id_rank) * exp_rank * ncoords
+                 + 2 * SliceBytes()
+                 + sizeof(double) * static_cast<size_t>(nids) * nids;
+    if( memory_budget <= fixed + SliceBytes() ) {
+      cerr << "Memory budget too small, caching a single identity." << endl;
+      return 1;
+    }
+    return std::min<size_t>(nids, (memory_budget - fixed) / SliceBytes());
+  }
+
+  void ComputeGramMatrices(int id_rank, int exp_rank, MatrixXd &G0, MatrixXd &G1) const {
+    const int block = BlockSize(id_rank, exp_rank);
+    const Index slice_size = static_cast<Index>(nexprs) * ncoords;
+    G0 = MatrixXd::Zero(nids, nids);
+    G1 = MatrixXd::Zero(nexprs, nexprs);
+
+    // X holds one vectorized slice per row
+    using RowMajorMatrixXd = Matrix<double, Dynamic, Dynamic, RowMajor>;
+    RowMajorMatrixXd X;
+    MatrixXd S;
+    for(int b0=0;b0<nids;b0+=block) {
+      const int nb = std::min(block, nids - b0);
+      cout << "Gram pass for identities " << b0 << " to " << b0 + nb - 1 << endl;
+      X.resize(nb, slice_size);
+      for(int a=0;a<nb;++a) {
+        loader(b0 + a, S);
+        X.row(a) = Map<const RowVectorXd>(S.data(), slice_size);
+        if( b0 == 0 ) G1.selfadjointView<Lower>().rankUpdate(S);
+      }
+      G0.block(b0, b0, nb, nb).selfadjointView<Lower>().rankUpdate(X);
+
+      // the identities after this block are streamed past it
+      for(int j=b0+nb;j<nids;++j) {
+        loader(j, S);
+        G0.block(j, b0, 1, nb).noalias() =
+          (X * Map<const VectorXd>(S.data(), slice_size)).transpose();
+        if( b0 == 0 ) G1.selfadjointView<Lower>().rankUpdate(S);
+      }
+    }
+    cout << "done." << endl;
+  }
+
+  // Leading eigenvectors of a Gram matrix with its lower triangle filled
+  static MatrixXd LeadingEigenvectors(const MatrixXd &G, int rank) {
+    SelfAdjointEigenSolver<MatrixXd> eig(G);
+    return eig.eigenvectors().rightCols(rank).rowwise().reverse();
+  }
+
+  int nids, nexprs, ncoords;
+  SliceLoader loader;
+  size_t memory_budget;
+};
+
+#endif // STREAMINGHOSVD_H
@@ -2,6 +2,14 @@
 #define TENSOR_HPP
 
 #include "common.h"
+#include "tensorfile.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <random>
 
 #ifndef MKL_BLAS
 #define MKL_BLAS MKL_DOMAIN_BLAS
@@ -56,25 +64,50 @@ public:
 
   VectorXd operator*(const VectorXd &v) const { return data * v; }
 
-  static Tensor2 FoldByColumn(Tensor1& v, int nrows, int ncols) {
+  using RowMajorMatrixXd = Matrix<double, Dynamic, Dynamic, RowMajor>;
+
+  // Views of a vector as a nrows x ncols matrix, no copy involved:
+  //   RowMajorView: (i, j) = v(i*ncols + j), the layout of Unfold
+  //   ColMajorView: (i, j) = v(j*nrows + i)
+  // Use them directly wherever an Eigen expression is accepted; FoldByColumn
+  // and FoldByRow are copies of these views.
+  static Map<RowMajorMatrixXd> RowMajorView(Tensor1 &v, int nrows, int ncols) {
+    assert(v.size() == static_cast<Index>(nrows) * ncols);
+    return Map<RowMajorMatrixXd>(v.data(), nrows, ncols);
+  }
+  static Map<const RowMajorMatrixXd> RowMajorView(const Tensor1 &v, int nrows, int ncols) {
+    assert(v.size() == static_cast<Index>(nrows) * ncols);
+    return Map<const RowMajorMatrixXd>(v.data(), nrows, ncols);
+  }
+  static Map<MatrixXd> ColMajorView(Tensor1 &v, int nrows, int ncols) {
+    assert(v.size() == static_cast<Index>(nrows) * ncols);
+    return Map<MatrixXd>(v.data(), nrows, ncols);
+  }
+  static Map<const MatrixXd> ColMajorView(const Tensor1 &v, int nrows, int ncols) {
+    assert(v.size() == static_cast<Index>(nrows) * ncols);
+    return Map<const MatrixXd>(v.data(), nrows, ncols);
+  }
+
+  // The elements in storage order, i.e. column by column
+  Map<VectorXd> Flatten() { return Map<VectorXd>(data.data(), data.size()); }
+  Map<const VectorXd> Flatten() const { return Map<const VectorXd>(data.data(), data.size()); }
+
+  static Tensor2 FoldByColumn(const Tensor1& v, int nrows, int ncols) {
     Tensor2 t;
-    t.data = Eigen::Map<MatrixXd>(v.data(), ncols, nrows).transpose();
+    t.data = RowMajorView(v, nrows, ncols);
     return t;
   }
 
-  static Tensor2 FoldByRow(Tensor1& v, int nrows, int ncols) {
+  static Tensor2 FoldByRow(const Tensor1& v, int nrows, int ncols) {
     Tensor2 t;
-    t.data = Eigen::Map<MatrixXd>(v.data(), nrows, ncols);
+    t.data = ColMajorView(v, nrows, ncols);
     return t;
   }
 
+  // v(i*cols + j) = (i, j), one transposing copy
   void Unfold(Tensor1 &v) const {
-    v.resize(rows()*cols());
-    for(int i=0,idx=0;i<rows();++i) {
-      for(int j=0;j<cols();++j,++idx) {
-        v(idx) = this->operator()(i, j);
-      }
-    }
+    v.resize(data.size());
+    RowMajorView(v, rows(), cols()) = data;
   }
 
   Tensor1 Unfold() const {
@@ -105,45 +138,55 @@ public:
     os << (*this) << endl;
   }
 
+  // Reads both the versioned and the legacy format
   bool Read(const string& filename) {
     try {
       cout << "reading tensor to file " << filename << endl;
-      fstream fin;
-      fin.open(filename, ios::in | ios::binary);
-
-      int m, n;
-
-      fin.read(reinterpret_cast<char*>(&(m)), sizeof(int));
-      fin.read(reinterpret_cast<char*>(&(n)), sizeof(int));
-      cout << "tensor size = " << m << "x" << n << endl;
-      data.resize(m, n);
-      fin.read(reinterpret_cast<char*>(data.data()), sizeof(double)*m*n);
+      if( TensorFile::IsVersioned(filename) ) {
+        // small enough that it is copied out of the file
+        TensorFileHeader header;
+        shared_ptr<double> payload = TensorFile::Read(filename, header);
+        if( header.order != 2 ) throw string("Not an order 2 tensor: ") + filename;
+        cout << "tensor size = " << header.dims[0] << "x" << header.dims[1] << endl;
+        data = Map<const MatrixXd>(payload.get(), header.dims[0], header.dims[1]);
+        cout << "done." << endl;
+        return true;
+      }
 
-      fin.close();
+      TensorFile::ReadLegacy(filename, 2, [&](const int *dims) {
+        cout << "tensor size = " << dims[0] << "x" << dims[1] << endl;
+        data.resize(dims[0], dims[1]);
+        return data.data();
+      });
 
       cout << "done." << endl;
       return true;
     }
+    catch(const string &msg) {
+      cerr << msg << endl;
+      return false;
+    }
     catch(...) {
-      cerr << "Failed to write tensor to file " << filename << endl;
+      cerr << "Failed to read tensor from file " << filename << endl;
       return false;
     }
   }
 
-  bool Write(const string& filename) {
+  // Writes the versioned format unless legacy is set
+  bool Write(const string& filename, bool legacy = false) {
     try {
       cout << "writing tensor to file " << filename << endl;
       int m = rows(), n = cols();
 
-      fstream fout;
-      fout.open(filename, ios::out | ios::binary);
-
-      fout.write(reinterpret_cast<const char*>(&(m)), sizeof(int));
-      fout.write(reinterpret_cast<const char*>(&(n)), sizeof(int));
-
-      fout.write(reinterpret_cast<const char*>(data.data()), sizeof(double)*m*n);
+      if( !legacy ) {
+        const int64_t dims[3] = {m, n, 1};
+        if( !TensorFile::Write(filename, 2, dims, data.data()) ) throw 0;
+        cout << "done." << endl;
+        return true;
+      }
 
-      fout.close();
+      const int dims[3] = {m, n, 1};
+      if( !TensorFile::WriteLegacy(filename, 2, dims, data.data()) ) throw 0;
 
       cout << "done." << endl;
       return true;
@@ -154,6 +197,19 @@ public:
     }
   }
 
+  // Writes the versioned format, byte-shuffled and compressed
+  bool WriteCompressed(const string& filename) {
+    cout << "writing compressed tensor to file " << filename << endl;
+    const int64_t dims[3] = {rows(), cols(), 1};
+    double ratio;
+    if( !TensorFile::Write(filename, 2, dims, data.data(), TensorFile::ShuffleLZ, &ratio) ) {
+      cerr << "Failed to write tensor to file " << filename << endl;
+      return false;
+    }
+    cout << "compression ratio = " << ratio << endl;
+    return true;
+  }
+
   const double* rawptr() const { return data.data(); }
   double* rawptr() { return data.data(); }
 
@@ -219,11 +275,28 @@ inline ostream& operator<<(ostream& os, const Tensor2& t) {
   return os;
 }
 
+// Tensor3 keeps all of its elements in a single 64-byte aligned buffer. Layer i
+// occupies [i*m*n, (i+1)*m*n) and is stored as a column-major m x n matrix,
+// which is also the order used by the tensor files.
+//
+//   layer 0: | col 0 | col 1 | ... | col n-1 |
+//   layer 1: | col 0 | col 1 | ... | col n-1 |
+//   ...
+//
+// With this layout the mode-0 and mode-1 unfoldings are plain strided views of
+// the buffer (see ModeView0/ModeView1), and each layer is a view as well.
 class Tensor3 {
 public:
-  Tensor3(){}
-  Tensor3(int l, int m, int n):data(vector<Tensor2>(l, Tensor2(m, n))){}
-  Tensor3(std::initializer_list<std::initializer_list<std::initializer_list<double>>> l) {
+  using RowMajorMatrixXd = Matrix<double, Dynamic, Dynamic, RowMajor>;
+  using LayerMap = Map<MatrixXd>;
+  using ConstLayerMap = Map<const MatrixXd>;
+
+  static const size_t kAlignment = 64;
+
+  Tensor3() : nlayers(0), nrows(0), ncols(0), ptr(nullptr) {}
+  Tensor3(int l, int m, int n) : Tensor3() { resize(l, m, n); }
+  Tensor3(std::initializer_list<std::initializer_list<std::initializer_list<double>>> l)
+    : Tensor3() {
     int num_layers = l.size();
     int num_rows = l.begin()->size();
     int num_cols = l.begin()->begin()->size();
@@ -237,7 +310,7 @@ public:
         assert(lij->size() == num_cols);
         auto lijk = lij->begin();
         for(int k=0;k<num_cols;++k) {
-          data[i](j, k) = *lijk;
+          (*this)(i, j, k) = *lijk;
           ++lijk;
         }
         ++lij;
@@ -246,22 +319,103 @@ public:
     }
   }
 
+  Tensor3(const Tensor3 &other) : Tensor3() {
+    resize(other.layers(), other.rows(), other.cols());
+    std::copy(other.ptr, other.ptr + size(), ptr);
+  }
+
+  Tensor3(Tensor3 &&other) : Tensor3() { swap(other); }
+
+  Tensor3& operator=(const Tensor3 &other) {
+    if( this != &other ) {
+      resize(other.layers(), other.rows(), other.cols());
+      std::copy(other.ptr, other.ptr + size(), ptr);
+    }
+    return (*this);
+  }
+
+  Tensor3& operator=(Tensor3 &&other) {
+    swap(other);
+    return (*this);
+  }
+
+  // A tensor whose elements live at p inside a block owned by owner, which
+  // stays alive as long as the tensor refers to it. Copies of the view own
+  // their storage, as for any other tensor, and so does the view itself once
+  // it is resized or assigned to: writes never reach the owner's block.
+  static Tensor3 View(const shared_ptr<double> &owner, double *p, int l, int m, int n) {
+    Tensor3 t;
+    t.nlayers = l; t.nrows = m; t.ncols = n;
+    t.storage = shared_ptr<double>(owner, p);
+    t.ptr = p;
+    return t;
+  }
+
+  void swap(Tensor3 &other) {
+    std::swap(nlayers, other.nlayers);
+    std::swap(nrows, other.nrows);
+    std::swap(ncols, other.ncols);
+    std::swap(ptr, other.ptr);
+    std::swap(storage, other.storage);
+  }
+
+  // Reallocates the buffer when the number of elements changes, or when the
+  // buffer is shared with another tensor (see View). The content is left
+  // uninitialized.
   void resize(int l, int m, int n) {
-    data.resize(l, Tensor2(m, n));
+    size_t new_size = static_cast<size_t>(l) * m * n;
+    if( new_size != size() || IsShared() ) {
+      storage = AllocateStorage(new_size);
+      ptr = storage.get();
+    }
+    nlayers = l; nrows = m; ncols = n;
   }
 
-  int layers() const { return data.size(); }
-  int rows() const {
-    if( data.empty() ) return 0;
-    else return data.front().rows();
+  int layers() const { return nlayers; }
+  int rows() const { return nrows; }
+  int cols() const { return ncols; }
+  size_t size() const { return static_cast<size_t>(nlayers) * nrows * ncols; }
+  size_t layer_size() const { return static_cast<size_t>(nrows) * ncols; }
+
+  double &operator()(int i, int j, int k) {
+    return ptr[i * layer_size() + static_cast<size_t>(k) * nrows + j];
   }
-  int cols() const {
-    if( data.empty() ) return 0;
-    else return data.front().cols();
+  const double &operator()(int i, int j, int k) const {
+    return ptr[i * layer_size() + static_cast<size_t>(k) * nrows + j];
   }
 
-  double &operator()(int i, int j, int k) { return data[i](j, k); }
-  const double &operator()(int i, int j, int k) const { return data[i](j, k); }
+  // Layer i as a m x n matrix, no copy involved.
+  LayerMap layer(int i) {
+    return LayerMap(ptr + i * layer_size(), nrows, ncols);
+  }
+  ConstLayerMap layer(int i) const {
+    return ConstLayerMap(ptr + i * layer_size(), nrows, ncols);
+  }
+
+  // Views of the buffer as mode-n unfoldings:
+  //   ModeView0: l x (m*n) row-major, column k*m+j holds fiber T(:, j, k)
+  //   ModeView1: m x (n*l) column-major, column i*n+k holds fiber T(i, :, k)
+  // Their column orders differ from Unfold<Mode>, which keeps the classical
+  // ordering, but any operation that folds back through the same view (mode
+  // products, gram matrices, norms) can use them directly.
+  // The mode-2 unfolding has no single strided view; it is the stack of
+  // layer(i).transpose().
+  Map<RowMajorMatrixXd> ModeView0() {
+    return Map<RowMajorMatrixXd>(ptr, nlayers, static_cast<Index>(nrows) * ncols);
+  }
+  Map<const RowMajorMatrixXd> ModeView0() const {
+    return Map<const RowMajorMatrixXd>(ptr, nlayers, static_cast<Index>(nrows) * ncols);
+  }
+  Map<MatrixXd> ModeView1() {
+    return Map<MatrixXd>(ptr, nrows, static_cast<Index>(ncols) * nlayers);
+  }
+  Map<const MatrixXd> ModeView1() const {
+    return Map<const MatrixXd>(ptr, nrows, static_cast<Index>(ncols) * nlayers);
+  }
+
+  // All elements as one vector, in storage order
+  Map<VectorXd> Flatten() { return Map<VectorXd>(ptr, size()); }
+  Map<const VectorXd> Flatten() const { return Map<const VectorXd>(ptr, size()); }
 
   template<int Mode>
   void Unfold(Tensor2 &t) const{}
@@ -297,26 +451,37 @@ public:
   }
 
   template <int Mode>
-  void ModeProduct(const Tensor1 &v, Tensor2 &A) {}
+  void ModeProduct(const Tensor1 &v, Tensor2 &A) const {}
 
   template <int Mode>
-  Tensor2 ModeProduct(const Tensor1 &v) {
+  Tensor2 ModeProduct(const Tensor1 &v) const {
     Tensor2 A;
     ModeProduct<Mode>(v, A);
     return A;
   }
 
+  // At = (T x_1 v)^T, the n x l transpose of ModeProduct<1>. Column i of At
+  // holds the products of v with the fibers T(i, :, k), k = 0..n-1, which are
+  // consecutive columns of ModeView1, so a single GEMV over the view writes At
+  // in its column-major layout.
+  void TransposedModeProduct1(const Tensor1 &v, Tensor2 &At) const {
+    const int l = layers(), n = cols();
+    At.resize(n, l);
+    Map<VectorXd>(At.rawptr(), static_cast<Index>(n) * l).noalias() =
+      ModeView1().transpose() * v;
+  }
+
   template <int Mode>
-  void ModeProduct(const Tensor2 &A, Tensor3 &t) {}
+  void ModeProduct(const Tensor2 &A, Tensor3 &t) const {}
 
   template <int Mode>
-  Tensor3 ModeProduct(const Tensor2 &A) {
+  Tensor3 ModeProduct(const Tensor2 &A) const {
     Tensor3 t;
     ModeProduct<Mode>(A, t);
     return t;
   }
 
-  Tensor3 ModeProduct(const Tensor2 &A, int mid) {
+  Tensor3 ModeProduct(const Tensor2 &A, int mid) const {
     switch( mid ) {
     case 0:
       return ModeProduct<0>(A);
@@ -329,29 +494,105 @@ public:
     }
   }
 
-  tuple<Tensor3, vector<Tensor2>> svd(const vector<int> &modes,
-                                       const vector<int> &dims) const {
-    vector<MatrixXd> U, V;
-    vector<VectorXd> s;
+  // Methods for computing the leading left singular vectors of an unfolding:
+  //   Jacobi:     full JacobiSVD of the materialized unfolding, then truncated
+  //   Gram:       eigen decomposition of X*X^T, exact; only practical when the
+  //               mode dimension is small (e.g. 150 identities)
+  //   Randomized: randomized range finder with power iterations, computes
+  //               only the requested rank
+  //   Auto:       Gram for mode dimensions up to kMaxGramDim, Randomized
+  //               otherwise
+  enum SVDMethod { Jacobi, Gram, Randomized, Auto };
+
+  static const int kMaxGramDim = 4096;
+
+  int dim(int mode) const {
+    switch(mode) {
+    case 0: return layers();
+    case 1: return rows();
+    case 2: return cols();
+    default: throw "Unsupported mode!";
+    }
+  }
 
-    for(auto mid : modes) {
-      cout << "svd on mode " << mid << endl;
+  // Leading rank left singular vectors of the mode-mid unfolding, and the
+  // corresponding singular values if s is not null.
+  MatrixXd LeadingSingularVectors(int mid, int rank, SVDMethod method,
+                                  VectorXd *s = nullptr) const {
+    assert(rank <= dim(mid));
+    if( method == Auto ) {
+      method = (dim(mid) <= kMaxGramDim)?Gram:Randomized;
+    }
 
-      // unfold in mode mid
-      Tensor2 t2 = Unfold(mid);
+    MatrixXd U;
+    VectorXd sv;
+    switch(method) {
+    case Jacobi: {
+      auto svd = Unfold(mid).svd_econ();
+      U = svd.matrixU().leftCols(rank);
+      sv = svd.singularValues().head(std::min<int>(rank, svd.singularValues().size()));
+      break;
+    }
+    case Gram: {
+      SelfAdjointEigenSolver<MatrixXd> eig(UnfoldingGram(mid));
+      U = eig.eigenvectors().rightCols(rank).rowwise().reverse();
+      sv = eig.eigenvalues().tail(rank).reverse().cwiseMax(0).cwiseSqrt();
+      break;
+    }
+    case Randomized:
+    default: {
+      // Halko, Martinsson and Tropp, "Finding structure with randomness"
+      const int oversampling = 10, power_iterations = 2;
+      const int nsamples = std::min(rank + oversampling, dim(mid));
+      const size_t ncols = size() / dim(mid);
+
+      auto orthonormalize = [](const MatrixXd &Y) {
+        HouseholderQR<MatrixXd> qr(Y);
+        return (qr.householderQ() * MatrixXd::Identity(Y.rows(), Y.cols())).eval();
+      };
+
+      std::mt19937 gen(mid);
+      std::normal_distribution<double> normal;
+      MatrixXd Omega(ncols, nsamples);
+      for(Index j=0;j<Omega.size();++j) Omega.data()[j] = normal(gen);
+
+      MatrixXd Q = orthonormalize(UnfoldingProduct(mid, Omega));
+      for(int i=0;i<power_iterations;++i) {
+        MatrixXd Z = orthonormalize(UnfoldingTransposeProduct(mid, Q));
+        Q = orthonormalize(UnfoldingProduct(mid, Z));
+      }
 
-      // compute svd
-      MatrixXd Ui, Vi;
-      VectorXd si;
+      // B = Q^T X is small, its left singular vectors come from B*B^T
+      MatrixXd Bt = UnfoldingTransposeProduct(mid, Q);
+      SelfAdjointEigenSolver<MatrixXd> eig(Bt.transpose() * Bt);
+      U = Q * eig.eigenvectors().rightCols(rank).rowwise().reverse();
+      sv = eig.eigenvalues().tail(rank).reverse().cwiseMax(0).cwiseSqrt();
+      break;
+    }
+    }
 
-      auto svd = t2.svd_econ();
-      Ui = svd.matrixU();
-      si = svd.singularValues();
+    if( s ) *s = sv;
+    return U;
+  }
 
-      cout << "done." << endl;
-      // store the svd results
-      U.push_back(Ui); V.push_back(Vi); s.push_back(si);
+  tuple<Tensor3, vector<Tensor2>> svd(const vector<int> &modes,
+                                       const vector<int> &dims,
+                                       SVDMethod method = Jacobi) const {
+    // the decompositions of different modes are independent, run them
+    // concurrently
+    vector<MatrixXd> U(modes.size());
+    vector<thread> workers;
+    for(size_t i=0;i<modes.size();i++) {
+      cout << "svd on mode " << modes[i] << endl;
+      workers.push_back(thread([&, i]() {
+        // The Jacobi path keeps the full U so that untruncated decompositions
+        // behave as before.
+        int rank = (method == Jacobi)?dim(modes[i]):dims[i];
+        U[i] = LeadingSingularVectors(modes[i], rank, method);
+      }));
     }
+    for(auto &w : workers) w.join();
+    cout << "done." << endl;
 
     // decompose the tensor, with truncation
     Tensor3 core = (*this);
@@ -369,6 +610,61 @@ public:
     return make_tuple(core, tu);
   }
 
+  // Truncated decomposition refined with higher-order orthogonal iteration
+  // (De Lathauwer et al. 2000). Starts from the truncated HOSVD and updates one
+  // factor at a time from the tensor projected onto all other factors, until
+  // the relative reconstruction error improves by less than tol or max_iters
+  // sweeps are done. Reaches a lower error than HOSVD at the same ranks.
+  tuple<Tensor3, vector<Tensor2>> hooi(const vector<int> &modes,
+                                        const vector<int> &dims,
+                                        int max_iters = 10,
+                                        double tol = 1e-6,
+                                        SVDMethod method = Auto) const {
+    auto comp = svd(modes, dims, method);
+    vector<MatrixXd> U;
+    for(auto &tu : std::get<1>(comp)) U.push_back(tu.GetData());
+
+    // the factors are orthonormal, so the error follows from the core norm
+    const double norm_t = norm();
+    auto relative_error = [&](const Tensor3 &core) {
+      double r = norm_t * norm_t - core.norm() * core.norm();
+      return std::sqrt(std::max(r, 0.0)) / norm_t;
+    };
+
+    Tensor3 core = std::get<0>(comp);
+    double err = relative_error(core);
+    cout << "HOSVD relative error = " << err << endl;
+
+    for(int iter=0;iter<max_iters;++iter) {
+      for(size_t i=0;i<modes.size();++i) {
+        // project onto every factor except the one being updated, the mode
+        // products themselves are multithreaded. The first product reads this
+        // tensor directly, so the input is never copied.
+        Tensor3 Y;
+        const Tensor3 *src = this;
+        for(size_t j=0;j<modes.size();++j) {
+          if( j == i ) continue;
+          Y = src->ModeProduct(Tensor2(U[j].transpose()), modes[j]);
+          src = &Y;
+        }
+        U[i] = src->LeadingSingularVectors(modes[i], dims[i], method);
+        if( i + 1 == modes.size() ) {
+          core = src->ModeProduct(Tensor2(U[i].transpose()), modes[i]);
+        }
+      }
+
+      double err_new = relative_error(core);
+      cout << "HOOI sweep " << iter << ": relative error = " << err_new << endl;
+      bool converged = (err - err_new) < tol;
+      err = err_new;
+      if( converged ) break;
+    }
+
+    vector<Tensor2> tu;
+    for(auto &Ui : U) tu.push_back(Tensor2(Ui));
+    return make_tuple(core, tu);
+  }
+
   tuple<Tensor3, Tensor2, Tensor2, Tensor2> svd() const {
     vector<int> modes{0, 1, 2};
     vector<int> dims{layers(), rows(), cols()};
@@ -378,12 +674,7 @@ public:
   }
 
   double norm() const {
-    int num_elements = layers() * rows() * cols();
-    return sqrt(std::accumulate(data.begin(), data.end(), 0.0,
-                                [](double val, const Tensor2& t){
-                                  double t_norm = t.norm();
-                                  return val + t_norm * t_norm;
-                                }));
+    return Flatten().norm();
   }
 
   void Print(const string& title="") const {
@@ -392,54 +683,63 @@ public:
     cout << (*this) << endl;
   }
 
-  bool Read(const string& filename) {
+  // Reads both the versioned and the legacy format. A versioned file is mapped
+  // and used as the storage without copying unless map is false; the mapping
+  // is private, so writing to the tensor never modifies the file. Otherwise,
+  // and for compressed files, the file is read with parallel chunked reads.
+  bool Read(const string& filename, bool map = true) {
     try {
       cout << "Reading tensor file " << filename << endl;
-      fstream fin;
-      fin.open(filename, ios::in | ios::binary);
-
-      int l, m, n;
-      fin.read(reinterpret_cast<char*>(&(l)), sizeof(int));
-      fin.read(reinterpret_cast<char*>(&(m)), sizeof(int));
-      fin.read(reinterpret_cast<char*>(&(n)), sizeof(int));
-
-      this->resize(l, m, n);
-
-      for(int i=0;i<l;i++) {
-        Tensor2& ti = data[i];
-        fin.read(reinterpret_cast<char*>(ti.rawptr()), sizeof(double)*m*n);
+      if( TensorFile::IsVersioned(filename) ) {
+        TensorFileHeader header;
+        shared_ptr<double> payload = map?TensorFile::Map(filename, header)
+                                        :TensorFile::Read(filename, header);
+        if( header.order != 3 ) throw string("Not an order 3 tensor: ") + filename;
+        for(int i=0;i<3;++i) {
+          if( header.dims[i] > std::numeric_limits<int>::max() )
+            throw string("Tensor dimensions too large: ") + filename;
+        }
+        nlayers = header.dims[0]; nrows = header.dims[1]; ncols = header.dims[2];
+        storage = payload;
+        ptr = storage.get();
+        cout << "done." << endl;
+        return true;
       }
 
-      fin.close();
+      TensorFile::ReadLegacy(filename, 3, [&](const int *dims) {
+        this->resize(dims[0], dims[1], dims[2]);
+        return ptr;
+      });
 
       cout << "done." << endl;
 
       return true;
     }
+    catch(const string &msg) {
+      cerr << msg << endl;
+      return false;
+    }
     catch( ... ) {
       cerr << "Failed to read tensor from file " << filename << endl;
       return false;
     }
   }
 
-  bool Write(const string& filename) {
+  // Writes the versioned format unless legacy is set
+  bool Write(const string& filename, bool legacy = false) {
     try {
       cout << "writing tensor to file " << filename << endl;
       int l = layers(), m = rows(), n = cols();
 
-      fstream fout;
-      fout.open(filename, ios::out | ios::binary);
-
-      fout.write(reinterpret_cast<char*>(&(l)), sizeof(int));
-      fout.write(reinterpret_cast<char*>(&(m)), sizeof(int));
-      fout.write(reinterpret_cast<char*>(&(n)), sizeof(int));
-
-      for(int i=0;i<l;i++) {
-        const Tensor2& ti = data[i];
-        fout.write(reinterpret_cast<const char*>(ti.rawptr()), sizeof(double)*m*n);
+      if( !legacy ) {
+        const int64_t dims[3] = {l, m, n};
+        if( !TensorFile::Write(filename, 3, dims, ptr) ) throw 0;
+        cout << "done." << endl;
+        return true;
       }
 
-      fout.close();
+      const int dims[3] = {l, m, n};
+      if( !TensorFile::WriteLegacy(filename, 3, dims, ptr) ) throw 0;
 
       cout << "done." << endl;
       return true;
@@ -450,6 +750,20 @@ public:
     }
   }
 
+  // Writes the versioned format, byte-shuffled and compressed. Reading it
+  // decompresses into owned storage instead of mapping the file.
+  bool WriteCompressed(const string& filename) {
+    cout << "writing compressed tensor to file " << filename << endl;
+    const int64_t dims[3] = {layers(), rows(), cols()};
+    double ratio;
+    if( !TensorFile::Write(filename, 3, dims, ptr, TensorFile::ShuffleLZ, &ratio) ) {
+      cerr << "Failed to write tensor to file " << filename << endl;
+      return false;
+    }
+    cout << "compression ratio = " << ratio << endl;
+    return true;
+  }
+
   friend bool operator==(const Tensor3& a, const Tensor3& b);
   friend bool operator!=(const Tensor3& a, const Tensor3& b);
 
@@ -457,165 +771,282 @@ public:
   friend Tensor3 operator-(const Tensor3& a, const Tensor3& b);
   friend ostream& operator<<(ostream& os, const Tensor3& t);
 
+  const double* rawptr() const { return ptr; }
+  double* rawptr() { return ptr; }
+
+  // The block holding the elements, e.g. to make views sharing it
+  const shared_ptr<double>& GetStorage() const { return storage; }
+
+private:
+  // Products with the mode-mid unfolding X without materializing it. The
+  // columns of X are taken in the order of the buffer views (ModeView0,
+  // ModeView1, and layer by layer for mode 2); the left singular vectors of X
+  // do not depend on that order.
+
+  // Returns X * B
+  MatrixXd UnfoldingProduct(int mid, const MatrixXd &B) const {
+    switch(mid) {
+    case 0: return ModeView0() * B;
+    case 1: return ModeView1() * B;
+    default: {
+      const int m = rows();
+      MatrixXd Y = MatrixXd::Zero(cols(), B.cols());
+      for(int i=0;i<layers();++i) {
+        Y.noalias() += layer(i).transpose() * B.middleRows(i*m, m);
+      }
+      return Y;
+    }
+    }
+  }
+
+  // Returns X^T * Y
+  MatrixXd UnfoldingTransposeProduct(int mid, const MatrixXd &Y) const {
+    switch(mid) {
+    case 0: return ModeView0().transpose() * Y;
+    case 1: return ModeView1().transpose() * Y;
+    default: {
+      const int m = rows();
+      MatrixXd Z(static_cast<Index>(layers()) * m, Y.cols());
+      #pragma omp parallel for
+      for(int i=0;i<layers();++i) {
+        Z.middleRows(i*m, m).noalias() = layer(i) * Y;
+      }
+      return Z;
+    }
+    }
+  }
+
+  // Returns X * X^T, only the lower triangle is filled
+  MatrixXd UnfoldingGram(int mid) const {
+    MatrixXd G = MatrixXd::Zero(dim(mid), dim(mid));
+    switch(mid) {
+    case 0: G.selfadjointView<Lower>().rankUpdate(ModeView0()); break;
+    case 1: G.selfadjointView<Lower>().rankUpdate(ModeView1()); break;
+    default:
+      for(int i=0;i<layers();++i) {
+        G.selfadjointView<Lower>().rankUpdate(layer(i).transpose());
+      }
+    }
+    return G;
+  }
+
+  // Tile edge, in elements, of the blocked transpose kernels below. A 32x32
+  // tile of doubles is 8KB, so source and destination tiles stay in L1.
+  static const int kTileSize = 32;
+
+  // dst = src^T for a rows x cols column-major block. The output is walked tile
+  // by tile so both sides stay cache resident; the inner loop writes a
+  // contiguous run of dst and is vectorized.
+  static void TransposeTile(const double *src, size_t lds, double *dst, size_t ldd,
+                            int r0, int r1, int c0, int c1) {
+    for(int r=r0;r<r1;++r) {
+      double *d = dst + r * ldd;
+      const double *s = src + r;
+      #pragma omp simd
+      for(int c=c0;c<c1;++c) d[c] = s[c * lds];
+    }
+  }
+
+  // Copies an a x b grid of contiguous vectors of length len into the b x a
+  // grid, i.e. vector (p, q) goes from src[(p*b+q)*len] to dst[(q*a+p)*len].
+  // This is the data movement behind the mode-1 unfolding.
+  static void TransposeVectorGrid(const double *src, double *dst,
+                                  int a, int b, int len) {
+    const int nta = (a + kTileSize - 1) / kTileSize;
+    const int ntb = (b + kTileSize - 1) / kTileSize;
+    #pragma omp parallel for collapse(2) schedule(static)
+    for(int tq=0;tq<ntb;++tq) {
+      for(int tp=0;tp<nta;++tp) {
+        const int q1 = std::min(b, (tq + 1) * kTileSize);
+        const int p1 = std::min(a, (tp + 1) * kTileSize);
+        for(int q=tq*kTileSize;q<q1;++q) {
+          for(int p=tp*kTileSize;p<p1;++p) {
+            const double *s = src + (static_cast<size_t>(p) * b + q) * len;
+            double *d = dst + (static_cast<size_t>(q) * a + p) * len;
+            #pragma omp simd
+            for(int x=0;x<len;++x) d[x] = s[x];
+          }
+        }
+      }
+    }
+  }
+
+  // Transposes count rows x cols column-major matrices. Matrix i starts at
+  // src + i*src_step with leading dimension lds, and its transpose is written
+  // to dst + i*dst_step with leading dimension ldd. Work is split over output
+  // tiles of all matrices at once, so a few large matrices still keep every
+  // thread busy.
+  static void TransposeBatch(const double *src, size_t src_step, size_t lds,
+                             double *dst, size_t dst_step, size_t ldd,
+                             int count, int rows, int cols) {
+    const int ntr = (rows + kTileSize - 1) / kTileSize;
+    const int ntc = (cols + kTileSize - 1) / kTileSize;
+    const int ntiles = ntr * ntc;
+    #pragma omp parallel for collapse(2) schedule(static)
+    for(int i=0;i<count;++i) {
+      for(int tile=0;tile<ntiles;++tile) {
+        const int tr = tile % ntr, tc = tile / ntr;
+        TransposeTile(src + i * src_step, lds, dst + i * dst_step, ldd,
+                      tr * kTileSize, std::min(rows, (tr + 1) * kTileSize),
+                      tc * kTileSize, std::min(cols, (tc + 1) * kTileSize));
+      }
+    }
+  }
+
+  static shared_ptr<double> AllocateStorage(size_t n) {
+    if( n == 0 ) return shared_ptr<double>();
+    void *p = nullptr;
+    if( posix_memalign(&p, kAlignment, sizeof(double) * n) != 0 )
+      throw std::bad_alloc();
+    return shared_ptr<double>(static_cast<double*>(p), [](double *p){ free(p); });
+  }
+
+  // True for a view into a block it does not start, or for a block another
+  // tensor or owner still refers to
+  bool IsShared() const {
+    return storage && (storage.get() != ptr || storage.use_count() > 1);
+  }
+
 private:
-  vector<Tensor2> data;
+  int nlayers, nrows, ncols;
+  double *ptr;                  // points into storage
+  shared_ptr<double> storage;
 };
 
+// t(i, j*n+k) = T(i, j, k), i.e. row i is layer i unfolded row by row
+// For a fixed k, the m x l block T(:, :, k)^T is scattered into columns
+// j*n+k, so the unfolding is a batch of n small strided transposes.
 template<>
 inline void Tensor3::Unfold<0>(Tensor2 &t) const {
   int l = layers(), m = rows(), n = cols();
   t.resize(l, m*n);
-  #pragma omp parallel for
-  for(int i=0;i<l;++i) {
-    t.row(i) = data[i].Unfold();
-  }
+  TransposeBatch(ptr, m, layer_size(), t.rawptr(), l, static_cast<size_t>(n) * l,
+                 n, m, l);
 }
 
+// t(j, k*l+i) = T(i, j, k)
+// Column k*l+i of the unfolding is column k of layer i, so this is a blocked
+// transpose of the l x n grid of columns.
 template<>
 inline void Tensor3::Unfold<1>(Tensor2 &t) const {
   int l = layers(), m = rows(), n = cols();
   t.resize(m, l*n);
-  #pragma omp parallel for
-  for(int i=0;i<l;++i) {
-    for(int j=0;j<m;++j) {
-      for(int k=0, offset=i;k<n;++k, offset+=l) {
-        t(j, offset) = data[i](j, k);
-      }
-    }
-  }
+  TransposeVectorGrid(ptr, t.rawptr(), l, n, m);
 }
 
+// t(k, i*m+j) = T(i, j, k)
+// Block i*m..(i+1)*m of the unfolding is layer i transposed.
 template<>
 inline void Tensor3::Unfold<2>(Tensor2 &t) const {
   int l = layers(), m = rows(), n = cols();
   t.resize(n, l*m);
-  for(int i=0, offset=0;i<l;++i, offset+=m) {
-    for(int j=0;j<m;++j) {
-      int jidx = offset + j;
-      for(int k=0;k<n;++k) {
-        t(k, jidx) = data[i](j, k);
-      }
-    }
-  }
+  TransposeBatch(ptr, layer_size(), m, t.rawptr(), layer_size(), n, l, m, n);
 }
 
 template <>
 inline void Tensor3::Fold<0>(const Tensor2 &A, int l, int m, int n, Tensor3 &t){
   t.resize(l, m, n);
-  #pragma omp parallel for
-  for(int i=0;i<l;++i) {
-    for(int j=0, offset=0;j<m;++j,offset+=n) {
-      for(int k=0;k<n;++k) {
-        t(i, j, k) = A(i, k+offset);
-      }
-    }
-  }
+  TransposeBatch(A.rawptr(), l, static_cast<size_t>(n) * l, t.rawptr(), m,
+                 t.layer_size(), n, l, m);
 }
 
 template <>
 inline void Tensor3::Fold<1>(const Tensor2 &A, int l, int m, int n, Tensor3 &t){
   t.resize(l, m, n);
-  #pragma omp parallel for
-  for(int i=0;i<l;++i) {
-    for(int j=0;j<m;++j) {
-      for(int k=0, offset=0;k<n;++k,offset+=l) {
-        t(i, j, k) = A(j, i+offset);
-      }
-    }
-  }
+  TransposeVectorGrid(A.rawptr(), t.rawptr(), n, l, m);
 }
 
 template <>
 inline void Tensor3::Fold<2>(const Tensor2 &A, int l, int m, int n, Tensor3 &t){
   t.resize(l, m, n);
-  for(int i=0,offset=0;i<l;++i,offset+=m) {
-    for(int j=0;j<m;++j) {
-      for(int k=0;k<n;++k) {
-        t(i, j, k) = A(k, j+offset);
-      }
-    }
-  }
+  TransposeBatch(A.rawptr(), t.layer_size(), n, t.rawptr(), t.layer_size(), m,
+                 l, n, m);
 }
 
+// A(i, j) = sum_k T(k, i, j) v(k)
 template <>
-inline void Tensor3::ModeProduct<0>(const Tensor1 &v, Tensor2 &A) {
-  int l = layers(), m = rows(), n = cols();
+inline void Tensor3::ModeProduct<0>(const Tensor1 &v, Tensor2 &A) const {
+  int m = rows(), n = cols();
   A.resize(m, n);
-  #pragma omp parallel for
-  for(int i=0;i<m;++i) {
-    for(int j=0;j<n;++j) {
-      double val = 0;
-      for(int k=0;k<l;++k) {
-        val += data[k](i, j) * v(k);
-      }
-      A(i, j) = val;
-    }
-  }
+  Map<VectorXd>(A.rawptr(), static_cast<Index>(m)*n).noalias() = ModeView0().transpose() * v;
 }
 
+// A(i, j) = sum_k T(i, k, j) v(k)
+// Each row of A is a GEMV over a layer; callers that can take A^T get all of
+// them from one GEMV with TransposedModeProduct1.
 template <>
-inline void Tensor3::ModeProduct<1>(const Tensor1 &v, Tensor2 &A) {
-  int l = layers(), m = rows(), n = cols();
+inline void Tensor3::ModeProduct<1>(const Tensor1 &v, Tensor2 &A) const {
+  int l = layers(), n = cols();
   A.resize(l, n);
   #pragma omp parallel for
   for(int i=0;i<l;++i) {
-    for(int j=0;j<n;++j) {
-      double val = 0;
-      for(int k=0;k<m;++k) {
-        val += data[i](k, j) * v(k);
-      }
-      A(i, j) = val;
-    }
+    A.row(i).noalias() = v.transpose() * layer(i);
   }
 }
 
+// A(i, j) = sum_k T(i, j, k) v(k)
 template <>
-inline void Tensor3::ModeProduct<2>(const Tensor1 &v, Tensor2 &A) {
+inline void Tensor3::ModeProduct<2>(const Tensor1 &v, Tensor2 &A) const {
   int l = layers(), m = rows();
   A.resize(l, m);
+  #pragma omp parallel for
   for(int i=0;i<l;++i) {
-    A.row(i) = (data[i] * v).transpose();
+    A.row(i).noalias() = (layer(i) * v).transpose();
   }
 }
 
+// The matrix mode products never materialize an unfolding. Each one is a
+// GEMM between A and a view of the source buffer, written straight into the
+// destination buffer:
+//   mode 0: t.ModeView0() = A * ModeView0()       [rows(A) x l] x [l x (m*n)]
+//   mode 1: t.ModeView1() = A * ModeView1()       [rows(A) x m] x [m x (n*l)]
+//   mode 2: t.layer(i) = layer(i) * A^T           one GEMM per layer
 template <>
-inline void Tensor3::ModeProduct<0>(const Tensor2 &A, Tensor3 &t) {
+inline void Tensor3::ModeProduct<0>(const Tensor2 &A, Tensor3 &t) const {
   int l = layers(), m = rows(), n = cols();
   assert(A.cols() == l); // size(A) = rows(A) x l
-  Tensor2 tu = Unfold<0>();   // l x (m*n)
-  Tensor2 t2(A.rows(), m*n);  // rows(A) x (m*n)
-  #pragma omp parallel for
-  for(int i=0;i<tu.cols();++i) {
-    t2.col(i) = A * tu.col(i);  // [ rows(A) x l ] x l -> rows(A)
+  if( &t == this ) {
+    Tensor3 res;
+    ModeProduct<0>(A, res);
+    t.swap(res);
+    return;
   }
-
-  t = Fold<0>(t2, A.rows(), m, n);
+  t.resize(A.rows(), m, n);
+  t.ModeView0().noalias() = A.GetData() * ModeView0();
 }
 
 template <>
-inline void Tensor3::ModeProduct<1>(const Tensor2 &A, Tensor3 &t) {
+inline void Tensor3::ModeProduct<1>(const Tensor2 &A, Tensor3 &t) const {
   int l = layers(), m = rows(), n = cols();
   assert(A.cols() == m); // size(A) = rows(A) x m
-  Tensor2 tu = Unfold<1>();
-  Tensor2 t2(A.rows(), l*n);
-  #pragma omp parallel for
-  for(int i=0;i<tu.cols();++i) {
-    t2.col(i) = A * tu.col(i);
+  if( &t == this ) {
+    Tensor3 res;
+    ModeProduct<1>(A, res);
+    t.swap(res);
+    return;
   }
-  t = Fold<1>(t2, l, A.rows(), n);
+  t.resize(l, A.rows(), n);
+  t.ModeView1().noalias() = A.GetData() * ModeView1();
 }
 
 template <>
-inline void Tensor3::ModeProduct<2>(const Tensor2 &A, Tensor3 &t) {
+inline void Tensor3::ModeProduct<2>(const Tensor2 &A, Tensor3 &t) const {
   int l = layers(), m = rows(), n = cols();
-  assert(A.cols() == n);
-  Tensor2 tu = Unfold<2>();
-  Tensor2 t2(A.rows(), l*m);
+  assert(A.cols() == n); // size(A) = rows(A) x n
+  if( &t == this ) {
+    Tensor3 res;
+    ModeProduct<2>(A, res);
+    t.swap(res);
+    return;
+  }
+  // The layer stride rules out a single matrix view for mode 2, so the product
+  // is a batch of independent per-layer GEMMs.
+  t.resize(l, m, A.rows());
+  const MatrixXd &At = A.GetData();
   #pragma omp parallel for
-  for(int i=0;i<tu.cols();++i) {
-    t2.col(i) = A * tu.col(i);
+  for(int i=0;i<l;++i) {
+    t.layer(i).noalias() = layer(i) * At.transpose();
   }
-  t = Fold<2>(t2, l, m, A.rows());
 }
 
 inline bool operator==(const Tensor3& a, const Tensor3& b) {
@@ -623,14 +1054,7 @@ inline bool operator==(const Tensor3& a, const Tensor3& b) {
   if( a.rows() != b.rows() ) return false;
   if( a.cols() != b.cols() ) return false;
 
-  for(int i=0;i<a.layers();++i) {
-    for(int j=0;j<a.rows();++j) {
-      for(int k=0;k<a.cols();++k) {
-        if( a(i, j, k) != b(i, j, k) ) return false;
-      }
-    }
-  }
-  return true;
+  return std::equal(a.rawptr(), a.rawptr() + a.size(), b.rawptr());
 }
 
 inline Tensor3 operator+(const Tensor3& a, const Tensor3& b) {
@@ -638,9 +1062,7 @@ inline Tensor3 operator+(const Tensor3& a, const Tensor3& b) {
   assert(a.rows() == b.rows());
   assert(a.cols() == b.cols());
   Tensor3 res(a.layers(), a.rows(), a.cols());
-  for(int i=0;i<a.layers();++i) {
-    res.data[i] = a.data[i] + b.data[i];
-  }
+  res.Flatten() = a.Flatten() + b.Flatten();
   return res;
 }
 
@@ -649,9 +1071,7 @@ inline Tensor3 operator-(const Tensor3& a, const Tensor3& b) {
   assert(a.rows() == b.rows());
   assert(a.cols() == b.cols());
   Tensor3 res(a.layers(), a.rows(), a.cols());
-  for(int i=0;i<a.layers();++i) {
-    res.data[i] = a.data[i] - b.data[i];
-  }
+  res.Flatten() = a.Flatten() - b.Flatten();
   return res;
 }
 
@@ -662,11 +1082,433 @@ inline bool operator!=(const Tensor3& a, const Tensor3& b) {
 inline ostream& operator<<(ostream& os, const Tensor3& t) {
   os << "{";
   for(int i=0;i<t.layers();i++) {
-    os << t.data[i];
+    os << "{" << t.layer(i) << "}";
     if( i < t.layers() - 1 ) os << endl;
   }
   os << "}";
   return os;
 }
 
+// Single precision copy of a Tensor3 with the same layout. The vector mode
+// products read the float elements and accumulate in double, so they move half
+// the bytes of the double precision ones at a small loss of accuracy.
+class Tensor3f {
+public:
+  Tensor3f() : nlayers(0), nrows(0), ncols(0) {}
+  explicit Tensor3f(const Tensor3 &t)
+    : nlayers(t.layers()), nrows(t.rows()), ncols(t.cols()),
+      data(t.Flatten().cast<float>()) {}
+
+  int layers() const { return nlayers; }
+  int rows() const { return nrows; }
+  int cols() const { return ncols; }
+  size_t size() const { return data.size(); }
+  size_t layer_size() const { return static_cast<size_t>(nrows) * ncols; }
+
+  float operator()(int i, int j, int k) const {
+    return data[i * layer_size() + static_cast<size_t>(k) * nrows + j];
+  }
+
+  Tensor3 ToDouble() const {
+    Tensor3 t(nlayers, nrows, ncols);
+    t.Flatten() = data.cast<double>();
+    return t;
+  }
+
+  template <int Mode>
+  void ModeProduct(const Tensor1 &v, Tensor2 &A) const {}
+
+  template <int Mode>
+  Tensor2 ModeProduct(const Tensor1 &v) const {
+    Tensor2 A;
+    ModeProduct<Mode>(v, A);
+    return A;
+  }
+
+  // At = (T x_1 v)^T, see Tensor3::TransposedModeProduct1
+  void TransposedModeProduct1(const Tensor1 &v, Tensor2 &At) const {
+    At.resize(ncols, nlayers);
+    ModeProduct1(v, At.rawptr(), ncols, 1);
+  }
+
+  const float* rawptr() const { return data.data(); }
+
+private:
+  // The mode 1 product of layer i and column k goes to dst[i*stride_i + k*stride_k]
+  void ModeProduct1(const Tensor1 &v, double *dst, size_t stride_i, size_t stride_k) const;
+
+  // Elements per block in the mode 0 product, the double accumulators of a
+  // block stay in L1
+  static const int kBlockSize = 512;
+
+  int nlayers, nrows, ncols;
+  VectorXf data;
+};
+
+// A(i, j) = sum_k T(k, i, j) v(k)
+// Blocks of the output are accumulated over all layers, so the core is read
+// once and the output written once.
+template <>
+inline void Tensor3f::ModeProduct<0>(const Tensor1 &v, Tensor2 &A) const {
+  const int l = layers();
+  const size_t ls = layer_size();
+  A.resize(rows(), cols());
+  double *dst = A.rawptr();
+  const float *src = rawptr();
+  const long nblocks = (ls + kBlockSize - 1) / kBlockSize;
+  #pragma omp parallel for
+  for(long b=0;b<nblocks;++b) {
+    const size_t p0 = b * kBlockSize, p1 = std::min(ls, p0 + kBlockSize);
+    const int len = p1 - p0;
+    double acc[kBlockSize] = {0};
+    // four layers per pass over the accumulators
+    int i = 0;
+    for(;i+4<=l;i+=4) {
+      const double v0 = v(i), v1 = v(i+1), v2 = v(i+2), v3 = v(i+3);
+      const float *s0 = src + i * ls + p0, *s1 = s0 + ls, *s2 = s1 + ls, *s3 = s2 + ls;
+      #pragma omp simd
+      for(int p=0;p<len;++p) {
+        acc[p] += (v0 * s0[p] + v1 * s1[p]) + (v2 * s2[p] + v3 * s3[p]);
+      }
+    }
+    for(;i<l;++i) {
+      const double vi = v(i);
+      const float *si = src + i * ls + p0;
+      #pragma omp simd
+      for(int p=0;p<len;++p) acc[p] += vi * si[p];
+    }
+    std::copy(acc, acc + len, dst + p0);
+  }
+}
+
+// A(i, j) = sum_k T(i, k, j) v(k)
+inline void Tensor3f::ModeProduct1(const Tensor1 &v, double *dst, size_t stride_i,
+                                   size_t stride_k) const {
+  const int l = layers(), m = rows(), n = cols();
+  const float *src = rawptr();
+  // The columns are short, four of them are reduced together to keep
+  // independent accumulators in flight.
+  #pragma omp parallel for
+  for(int i=0;i<l;++i) {
+    const float *si = src + i * layer_size();
+    double *di = dst + i * stride_i;
+    int j = 0;
+    for(;j+4<=n;j+=4) {
+      const float *c0 = si + static_cast<size_t>(j) * m;
+      const float *c1 = c0 + m, *c2 = c1 + m, *c3 = c2 + m;
+      double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+      for(int k=0;k<m;++k) {
+        const double vk = v(k);
+        s0 += vk * c0[k]; s1 += vk * c1[k];
+        s2 += vk * c2[k]; s3 += vk * c3[k];
+      }
+      di[j * stride_k] = s0; di[(j+1) * stride_k] = s1;
+      di[(j+2) * stride_k] = s2; di[(j+3) * stride_k] = s3;
+    }
+    for(;j<n;++j) {
+      const float *col = si + static_cast<size_t>(j) * m;
+      double s = 0;
+      for(int k=0;k<m;++k) s += v(k) * col[k];
+      di[j * stride_k] = s;
+    }
+  }
+}
+
+template <>
+inline void Tensor3f::ModeProduct<1>(const Tensor1 &v, Tensor2 &A) const {
+  A.resize(nlayers, ncols);
+  ModeProduct1(v, A.rawptr(), 1, nlayers);
+}
+
+// A(i, j) = sum_k T(i, j, k) v(k)
+template <>
+inline void Tensor3f::ModeProduct<2>(const Tensor1 &v, Tensor2 &A) const {
+  const int l = layers(), m = rows(), n = cols();
+  A.resize(l, m);
+  const float *src = rawptr();
+  #pragma omp parallel for
+  for(int i=0;i<l;++i) {
+    VectorXd acc = VectorXd::Zero(m);
+    const float *si = src + i * layer_size();
+    for(int k=0;k<n;++k) {
+      const double vk = v(k);
+      const float *col = si + static_cast<size_t>(k) * m;
+      #pragma omp simd
+      for(int j=0;j<m;++j) acc(j) += vk * col[j];
+    }
+    A.row(i) = acc.transpose();
+  }
+}
+
+// Element codecs for QuantizedTensor3. Elements are normalized to [-1, 1] per
+// slice before encoding; levels is the number of steps in [0, 1].
+template <typename Q> struct QuantizationTraits {};
+
+template <> struct QuantizationTraits<int8_t> {
+  static const char* Name() { return "int8"; }
+  static float Levels() { return 127.0f; }
+  static int8_t Encode(float y) {
+    return static_cast<int8_t>(std::lround(std::max(-1.0f, std::min(1.0f, y)) * 127.0f));
+  }
+};
+
+template <> struct QuantizationTraits<Eigen::half> {
+  static const char* Name() { return "fp16"; }
+  static float Levels() { return 1.0f; }
+  static Eigen::half Encode(float y) { return Eigen::half(y); }
+};
+
+// A Tensor3 stored with 8 or 16 bits per element, same layout as Tensor3. Each
+// slice T(i, j, :) has its own scale and offset:
+//   T(i, j, k) = offset(i, j) + scale(i, j) * q(i, j, k)
+// The vector mode products dequantize on the fly and accumulate in double.
+template <typename Q>
+class QuantizedTensor3 {
+public:
+  QuantizedTensor3() : nlayers(0), nrows(0), ncols(0) {}
+  explicit QuantizedTensor3(const Tensor3 &t)
+    : nlayers(t.layers()), nrows(t.rows()), ncols(t.cols()),
+      scale(t.rows(), t.layers()), offset(t.rows(), t.layers()),
+      data(t.size()) {
+    const int l = nlayers, m = nrows, n = ncols;
+    #pragma omp parallel for
+    for(int i=0;i<l;++i) {
+      for(int j=0;j<m;++j) {
+        double lo = std::numeric_limits<double>::max(), hi = -lo;
+        for(int k=0;k<n;++k) {
+          lo = std::min(lo, t(i, j, k));
+          hi = std::max(hi, t(i, j, k));
+        }
+        const double half_range = (n > 0)?std::max(0.5 * (hi - lo), 1e-300):1.0;
+        const double o = (n > 0)?0.5 * (hi + lo):0.0;
+        offset(j, i) = o;
+        scale(j, i) = half_range / QuantizationTraits<Q>::Levels();
+        for(int k=0;k<n;++k) {
+          data[index(i, j, k)] = QuantizationTraits<Q>::Encode((t(i, j, k) - o) / half_range);
+        }
+      }
+    }
+  }
+
+  int layers() const { return nlayers; }
+  int rows() const { return nrows; }
+  int cols() const { return ncols; }
+  size_t size() const { return data.size(); }
+  size_t layer_size() const { return static_cast<size_t>(nrows) * ncols; }
+
+  // Memory used by the elements and the per-slice parameters
+  size_t bytes() const {
+    return sizeof(Q) * data.size() + 2 * sizeof(double) * scale.size();
+  }
+
+  double operator()(int i, int j, int k) const {
+    return offset(j, i) + scale(j, i) * static_cast<float>(data[index(i, j, k)]);
+  }
+
+  Tensor3 ToDouble() const {
+    Tensor3 t(nlayers, nrows, ncols);
+    for(int i=0;i<nlayers;++i) Dequantize(i, 0, ncols, t.layer(i).data());
+    return t;
+  }
+
+  // Columns k0 to k0+nk-1 of layer i, dequantized into dst as a column-major
+  // rows() x nk matrix
+  void Dequantize(int i, int k0, int nk, double *dst) const {
+    for(int k=0;k<nk;++k)
+      for(int j=0;j<nrows;++j) dst[static_cast<size_t>(k) * nrows + j] = (*this)(i, j, k0 + k);
+  }
+
+  // Only the mode 0 and mode 1 products are provided
+  template <int Mode>
+  void ModeProduct(const Tensor1 &v, Tensor2 &A) const {
+    static_assert(Mode == 0 || Mode == 1, "Unsupported mode!");
+    if( Mode == 0 ) ModeProduct0(v, A);
+    else {
+      A.resize(nlayers, ncols);
+      ModeProduct1(v, A.rawptr(), 1, nlayers);
+    }
+  }
+
+  template <int Mode>
+  Tensor2 ModeProduct(const Tensor1 &v) const {
+    Tensor2 A;
+    ModeProduct<Mode>(v, A);
+    return A;
+  }
+
+  // At = (T x_1 v)^T, see Tensor3::TransposedModeProduct1
+  void TransposedModeProduct1(const Tensor1 &v, Tensor2 &At) const {
+    At.resize(ncols, nlayers);
+    ModeProduct1(v, At.rawptr(), ncols, 1);
+  }
+
+private:
+  size_t index(int i, int j, int k) const {
+    return i * layer_size() + static_cast<size_t>(k) * nrows + j;
+  }
+
+  // A(j, k) = sum_i v(i) offset(i, j) + sum_i v(i) scale(i, j) q(i, j, k)
+  void ModeProduct0(const Tensor1 &v, Tensor2 &A) const {
+    const int l = nlayers, m = nrows, n = ncols;
+    A.resize(m, n);
+    // column i of c holds the scales of layer i times v(i), contiguous in j
+    const MatrixXd c = scale.array().rowwise() * v.transpose().array();
+    const VectorXd b = offset * v;
+    const int block_cols = std::max(1, 2048 / std::max(m, 1));
+    const int nblocks = (n + block_cols - 1) / block_cols;
+    MatrixXd &M = A.GetData();
+    #pragma omp parallel for
+    for(int blk=0;blk<nblocks;++blk) {
+      const int k0 = blk * block_cols, nk = std::min(block_cols, n - k0);
+      auto acc = M.middleCols(k0, nk);
+      acc.colwise() = b;
+      for(int i=0;i<l;++i) {
+        const Q *qi = data.data() + index(i, 0, k0);
+        const double *ci = c.col(i).data();
+        for(int k=0;k<nk;++k) {
+          double *a = acc.col(k).data();
+          const Q *q = qi + static_cast<size_t>(k) * m;
+          #pragma omp simd
+          for(int j=0;j<m;++j) a[j] += ci[j] * static_cast<float>(q[j]);
+        }
+      }
+    }
+  }
+
+  // A(i, k) = sum_j v(j) offset(i, j) + sum_j v(j) scale(i, j) q(i, j, k),
+  // written to dst[i*stride_i + k*stride_k]
+  void ModeProduct1(const Tensor1 &v, double *dst, size_t stride_i, size_t stride_k) const {
+    const int l = nlayers, m = nrows, n = ncols;
+    #pragma omp parallel for
+    for(int i=0;i<l;++i) {
+      const VectorXd d = scale.col(i).cwiseProduct(v);
+      const double e = offset.col(i).dot(v);
+      const Q *qi = data.data() + index(i, 0, 0);
+      for(int k=0;k<n;++k) {
+        const Q *q = qi + static_cast<size_t>(k) * m;
+        double s = e;
+        for(int j=0;j<m;++j) s += d(j) * static_cast<float>(q[j]);
+        dst[i * stride_i + k * stride_k] = s;
+      }
+    }
+  }
+
+  int nlayers, nrows, ncols;
+  // m x l, one entry per slice; the slices of a layer are a contiguous column
+  MatrixXd scale, offset;
+  vector<Q> data;
+};
+
+using Tensor3h = QuantizedTensor3<Eigen::half>;
+using Tensor3i8 = QuantizedTensor3<int8_t>;
+
+// A lazily recorded chain of mode products on a Tensor3, e.g.
+//
+//   Tensor3 t = ModeProductChain(core).ModeProduct(U0, 0).ModeProduct(U1, 1).Eval();
+//
+// Products on different modes commute, so Eval picks the order with the fewest
+// flops from the dimensions before running anything. Vector products are
+// recorded as 1 x d matrices and leave that mode with dimension 1. The tensor
+// and the matrices are referenced, not copied, and must outlive the chain.
+class ModeProductChain {
+public:
+  explicit ModeProductChain(const Tensor3 &t) : src(&t) {}
+
+  ModeProductChain& ModeProduct(const Tensor2 &A, int mid) {
+    assert(mid >= 0 && mid < 3);
+    ops.push_back(Op{mid, &A, nullptr});
+    return (*this);
+  }
+
+  ModeProductChain& ModeProduct(const Tensor1 &v, int mid) {
+    assert(mid >= 0 && mid < 3);
+    shared_ptr<Tensor2> A = make_shared<Tensor2>(MatrixXd(v.transpose()));
+    ops.push_back(Op{mid, A.get(), A});
+    return (*this);
+  }
+
+  // Flops of the products in the given order
+  double Cost(const vector<int> &order) const {
+    double d[3] = {double(src->layers()), double(src->rows()), double(src->cols())};
+    double flops = 0;
+    for(int idx : order) {
+      const Op &op = ops[idx];
+      flops += 2.0 * op.A->rows() * d[0] * d[1] * d[2];
+      d[op.mode] = op.A->rows();
+    }
+    return flops;
+  }
+
+  // The cheapest order, products on the same mode keep their recorded order
+  vector<int> Order() const {
+    vector<int> order(ops.size()), best;
+    for(size_t i=0;i<ops.size();++i) order[i] = i;
+    double best_cost = std::numeric_limits<double>::max();
+    do {
+      if( !IsValidOrder(order) ) continue;
+      double c = Cost(order);
+      if( c < best_cost ) { best_cost = c; best = order; }
+    } while( std::next_permutation(order.begin(), order.end()) );
+    return best;
+  }
+
+  // Buffers for the intermediate results of Eval, owned by the caller. Each
+  // one holds the same intermediate every time a chain is evaluated, so it
+  // keeps its allocation and repeated evaluations only allocate t once.
+  struct Workspace {
+    Tensor3 buf[2];
+  };
+
+  // Runs the products in the cheapest order into t, which must not be the
+  // chain's tensor. The intermediate results alternate between the buffers
+  // of ws.
+  void Eval(Tensor3 &t, Workspace &ws) const {
+    assert(&t != src);
+    if( ops.empty() ) { t = (*src); return; }
+    vector<int> order = Order();
+    const Tensor3 *cur = src;
+    for(size_t s=0;s<order.size();++s) {
+      const Op &op = ops[order[s]];
+      Tensor3 &dst = (s + 1 == order.size())?t:ws.buf[s % 2];
+      switch(op.mode) {
+      case 0: cur->ModeProduct<0>(*op.A, dst); break;
+      case 1: cur->ModeProduct<1>(*op.A, dst); break;
+      case 2: cur->ModeProduct<2>(*op.A, dst); break;
+      }
+      cur = &dst;
+    }
+  }
+
+  void Eval(Tensor3 &t) const {
+    Workspace ws;
+    Eval(t, ws);
+  }
+
+  Tensor3 Eval() const {
+    Tensor3 t;
+    Eval(t);
+    return t;
+  }
+
+private:
+  struct Op {
+    int mode;
+    const Tensor2 *A;
+    shared_ptr<Tensor2> owned;    // set for vector products
+  };
+
+  bool IsValidOrder(const vector<int> &order) const {
+    int last[3] = {-1, -1, -1};
+    for(int idx : order) {
+      int mode = ops[idx].mode;
+      if( idx < last[mode] ) return false;
+      last[mode] = idx;
+    }
+    return true;
+  }
+
+  const Tensor3 *src;
+  vector<Op> ops;
+};
+
 #endif // TENSOR_HPP
@@ -0,0 +1,185 @@
+#ifndef TENSORCODEC_HPP
+#define TENSORCODEC_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Lossless compression of tensor payloads.
+//
+// Doubles of the same tensor share their sign and exponent bytes far more
+// often than their low mantissa bytes, so the payload is first byte-shuffled:
+// byte b of every element goes to plane b. The planes are then compressed
+// with a small LZ77 codec in the spirit of LZ4, which decodes at memory speed.
+//
+// A compressed block is a series of sequences:
+//   token         high nibble: literal count, low nibble: match length - 4,
+//                 a nibble of 15 is continued by bytes of 255 and a final byte
+//   literals
+//   offset        2 bytes, little endian, 1..65535 bytes back
+// The last sequence only has literals, and no offset.
+class TensorCodec {
+public:
+  // out[b * n + i] = byte b of element i, for n elements of size bytes. One
+  // sequential pass over the elements, writing every plane as a stream.
+  static void Shuffle(const char *in, size_t n, size_t size, char *out) {
+    if( size == 8 ) return Shuffle8(in, n, out);
+    for(size_t i=0;i<n;++i) {
+      for(size_t b=0;b<size;++b) out[b * n + i] = in[i * size + b];
+    }
+  }
+
+  static void Unshuffle(const char *in, size_t n, size_t size, char *out) {
+    if( size == 8 ) return Unshuffle8(in, n, out);
+    for(size_t i=0;i<n;++i) {
+      for(size_t b=0;b<size;++b) out[i * size + b] = in[b * n + i];
+    }
+  }
+
+  // Largest compressed size of n bytes
+  static size_t CompressBound(size_t n) { return n + n / 255 + 16; }
+
+  // Compresses n bytes into out, which has room for CompressBound(n) bytes.
+  // Returns the compressed size.
+  static size_t Compress(const char *in, size_t n, char *out) {
+    const uint8_t *src = reinterpret_cast<const uint8_t*>(in);
+    uint8_t *dst = reinterpret_cast<uint8_t*>(out);
+    std::vector<uint32_t> table(size_t(1) << kHashBits, 0);
+
+    size_t anchor = 0, pos = 0, misses = 0;
+    // matches may not start in the last bytes, which keeps the 4-byte reads
+    // in bounds
+    const size_t limit = (n > kMinMatch)?n - kMinMatch:0;
+    while( pos < limit ) {
+      const uint32_t h = Hash(Read32(src + pos));
+      const size_t cand = table[h];
+      table[h] = static_cast<uint32_t>(pos);
+      if( cand >= pos || pos - cand > kMaxOffset || Read32(src + cand) != Read32(src + pos) ) {
+        // the search speeds up through incompressible runs, as in LZ4
+        pos += 1 + (misses++ >> kSkipShift);
+        continue;
+      }
+      misses = 0;
+
+      size_t len = kMinMatch;
+      while( pos + len < n && src[cand + len] == src[pos + len] ) ++len;
+
+      dst = WriteSequence(dst, src + anchor, pos - anchor, len);
+      const size_t offset = pos - cand;
+      *dst++ = static_cast<uint8_t>(offset);
+      *dst++ = static_cast<uint8_t>(offset >> 8);
+      dst = WriteLength(dst, len - kMinMatch);
+
+      pos += len;
+      anchor = pos;
+    }
+
+    // trailing literals
+    dst = WriteSequence(dst, src + anchor, n - anchor, kMinMatch);
+    return dst - reinterpret_cast<uint8_t*>(out);
+  }
+
+  // Decompresses a block of in_bytes into exactly n bytes at out. Returns
+  // false if the block is malformed or does not decode to n bytes.
+  static bool Decompress(const char *in, size_t in_bytes, char *out, size_t n) {
+    const uint8_t *src = reinterpret_cast<const uint8_t*>(in);
+    const uint8_t *src_end = src + in_bytes;
+    uint8_t *dst = reinterpret_cast<uint8_t*>(out);
+    uint8_t *dst_begin = dst, *dst_end = dst + n;
+
+    while( src < src_end ) {
+      const uint8_t token = *src++;
+
+      size_t nlit = token >> 4;
+      if( nlit == 15 && !ReadLength(src, src_end, nlit) ) return false;
+      if( nlit > static_cast<size_t>(src_end - src) || nlit > static_cast<size_t>(dst_end - dst) )
+        return false;
+      memcpy(dst, src, nlit);
+      src += nlit; dst += nlit;
+
+      // the last sequence has no match
+      if( src == src_end ) break;
+
+      if( src_end - src < 2 ) return false;
+      const size_t offset = src[0] | (static_cast<size_t>(src[1]) << 8);
+      src += 2;
+      size_t len = token & 15;
+      if( len == 15 && !ReadLength(src, src_end, len) ) return false;
+      len += kMinMatch;
+      if( offset == 0 || offset > static_cast<size_t>(dst - dst_begin)
+          || len > static_cast<size_t>(dst_end - dst) )
+        return false;
+
+      const uint8_t *match = dst - offset;
+      if( offset >= len ) {
+        memcpy(dst, match, len);
+        dst += len;
+      }
+      else {
+        // overlapping copy repeats the last offset bytes
+        for(size_t i=0;i<len;++i) *dst++ = *match++;
+      }
+    }
+    return dst == dst_end;
+  }
+
+private:
+  static void Shuffle8(const char *in, size_t n, char *out) {
+    for(size_t i=0;i<n;++i) {
+      for(size_t b=0;b<8;++b) out[b * n + i] = in[i * 8 + b];
+    }
+  }
+
+  static void Unshuffle8(const char *in, size_t n, char *out) {
+    for(size_t i=0;i<n;++i) {
+      for(size_t b=0;b<8;++b) out[i * 8 + b] = in[b * n + i];
+    }
+  }
+
+  static const size_t kMinMatch = 4;
+  static const size_t kMaxOffset = 65535;
+  static const int kHashBits = 16;
+  static const int kSkipShift = 6;
+
+  static uint32_t Read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+  }
+
+  static uint32_t Hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - kHashBits);
+  }
+
+  // token, extra literal length bytes and the literals
+  static uint8_t* WriteSequence(uint8_t *dst, const uint8_t *lit, size_t nlit, size_t len) {
+    const size_t ml = len - kMinMatch;
+    *dst++ = static_cast<uint8_t>(((nlit < 15)?nlit:15) << 4 | ((ml < 15)?ml:15));
+    if( nlit >= 15 ) dst = WriteExtra(dst, nlit - 15);
+    memcpy(dst, lit, nlit);
+    return dst + nlit;
+  }
+
+  // extra match length bytes, only when the nibble overflowed
+  static uint8_t* WriteLength(uint8_t *dst, size_t ml) {
+    return (ml >= 15)?WriteExtra(dst, ml - 15):dst;
+  }
+
+  static uint8_t* WriteExtra(uint8_t *dst, size_t v) {
+    for(;v>=255;v-=255) *dst++ = 255;
+    *dst++ = static_cast<uint8_t>(v);
+    return dst;
+  }
+
+  static bool ReadLength(const uint8_t *&src, const uint8_t *src_end, size_t &v) {
+    uint8_t b;
+    do {
+      if( src == src_end ) return false;
+      b = *src++;
+      v += b;
+    } while( b == 255 );
+    return true;
+  }
+};
+
+#endif // TENSORCODEC_HPP
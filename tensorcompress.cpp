@@ -0,0 +1,45 @@
+#include "tensor.hpp"
+
+// Converts model files to the compressed container and reports the ratio.
+//
+// Usage: TensorCompress {tensor2|tensor3|bytes} input output
+//
+// tensor2/tensor3 read a factor matrix or a core tensor in any format. bytes
+// wraps any other file, e.g. the _aug prior files, as an opaque byte string.
+int main(int argc, char **argv) {
+  if( argc < 4 ) {
+    cout << "Usage: " << argv[0] << " {tensor2|tensor3|bytes} input output" << endl;
+    return -1;
+  }
+  const string kind = argv[1], input = argv[2], output = argv[3];
+
+  if( kind == "tensor2" ) {
+    Tensor2 t;
+    if( !t.Read(input) || !t.WriteCompressed(output) ) return -1;
+  }
+  else if( kind == "tensor3" ) {
+    Tensor3 t;
+    if( !t.Read(input) || !t.WriteCompressed(output) ) return -1;
+  }
+  else if( kind == "bytes" ) {
+    try {
+      double ratio;
+      if( !TensorFile::WriteBytes(output, TensorFile::ReadBytes(input),
+                                  TensorFile::ShuffleLZ, &ratio) ) {
+        cerr << "Failed to write " << output << endl;
+        return -1;
+      }
+      cout << "compression ratio = " << ratio << endl;
+    }
+    catch(const string &msg) {
+      cerr << msg << endl;
+      return -1;
+    }
+  }
+  else {
+    cerr << "Unknown file kind " << kind << endl;
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,603 @@
+#ifndef TENSORFILE_HPP
+#define TENSORFILE_HPP
+
+#include "common.h"
+#include "tensorcodec.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Versioned container for dense tensors.
+//
+//   [0, 128)           TensorFileHeader
+//   [payload_offset,   the elements, in the same order as the legacy files
+//    +payload_bytes)
+//
+// The payload starts on a 64-byte boundary, so a file mapped with mmap can be
+// used as tensor storage directly. The mapping is private: clean pages are
+// shared by every process that maps the same file, and a page is only copied
+// when a process writes to it.
+//
+// Dimensions and offsets are 64-bit. Version 1 files, with a 64-byte header
+// and 32-bit dimensions, are still read.
+//
+// With the ShuffleLZ codec the payload is split into chunks of checksum_block
+// bytes that are compressed independently (see TensorCodec), and stored as
+//   uint64_t sizes[nchunks]    compressed size of each chunk, equal to the
+//                              chunk size when it is stored uncompressed
+//   the compressed chunks, back to back
+// so that the chunks are decompressed in parallel. Such files are read, never
+// mapped.
+//
+// Order 1 files with 1-byte scalars hold opaque byte strings, used to ship the
+// other model files in the same container.
+//
+// Legacy files have no header, they start with the int dimensions followed by
+// the elements.
+struct TensorFileHeader {
+  char magic[8];              // TensorFile::Magic()
+  uint32_t version;           // kVersion
+  uint32_t byte_order;        // kByteOrderMark, in the writer's byte order
+  uint32_t order;             // 2 or 3
+  uint32_t scalar_bytes;      // sizeof(double), or 1 for byte strings
+  int64_t dims[3];            // unused trailing dimensions are 1
+  uint64_t payload_offset;
+  uint64_t payload_bytes;     // uncompressed
+  uint64_t checksum;          // TensorFile::Checksum of the uncompressed payload
+  uint64_t checksum_block;    // bytes per checksum block and compressed chunk,
+                              // a multiple of 8
+  uint32_t codec;             // TensorFile::Codec
+  uint32_t reserved0;
+  uint64_t stored_bytes;      // bytes of the payload area on disk
+  char reserved[32];
+
+  static const uint32_t kVersion = 2;
+  static const uint32_t kByteOrderMark = 0x01020304;
+  static const uint64_t kPayloadAlignment = 64;
+};
+static_assert(sizeof(TensorFileHeader) == 2 * TensorFileHeader::kPayloadAlignment,
+              "the payload must start on an aligned boundary after the header");
+
+// The 64-byte header of version 1 files
+struct TensorFileHeaderV1 {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t order;
+  uint32_t scalar_bytes;
+  int32_t dims[3];
+  uint32_t reserved;
+  uint64_t payload_offset;
+  uint64_t payload_bytes;
+  uint64_t checksum;          // TensorFile::Checksum, in one block
+};
+static_assert(sizeof(TensorFileHeaderV1) == 64, "version 1 header size");
+
+class TensorFile {
+public:
+  // Payloads are read, written and checksummed in chunks of this size, one
+  // chunk per thread at a time
+  static const size_t kChunkBytes = size_t(16) << 20;
+
+  enum Codec : uint32_t {
+    Raw = 0,
+    ShuffleLZ = 1
+  };
+
+  static const char* Magic() { return "TNSRFILE"; }
+
+  // FNV-1a over 64-bit words, a final partial word is zero padded
+  static uint64_t Checksum(const char *data, size_t bytes) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+    for(;i+8<=bytes;i+=8) {
+      uint64_t w;
+      memcpy(&w, data + i, 8);
+      h = (h ^ w) * 0x100000001b3ULL;
+    }
+    if( i < bytes ) {
+      uint64_t w = 0;
+      memcpy(&w, data + i, bytes - i);
+      h = (h ^ w) * 0x100000001b3ULL;
+    }
+    return h;
+  }
+
+  // FNV-1a over the checksums of consecutive blocks, which are computed in
+  // parallel. A single block gives the version 1 checksum.
+  static uint64_t Checksum(const char *data, size_t bytes, size_t block) {
+    if( bytes <= block ) return Checksum(data, bytes);
+    const long nblocks = static_cast<long>((bytes + block - 1) / block);
+    vector<uint64_t> hs(nblocks);
+    #pragma omp parallel for schedule(dynamic)
+    for(long b=0;b<nblocks;++b) {
+      const size_t offset = b * block;
+      hs[b] = Checksum(data + offset, std::min(block, bytes - offset));
+    }
+    return CombineChecksums(hs);
+  }
+
+  static bool IsVersioned(const string &filename) {
+    ifstream fin(filename, ios::in | ios::binary);
+    char magic[8];
+    if( !fin.read(magic, 8) ) return false;
+    return memcmp(magic, Magic(), 8) == 0;
+  }
+
+  // Reads/writes bytes at offset with positional io, splitting large requests
+  // into chunks serviced by parallel threads. Short transfers and EINTR are
+  // retried; returns false on any other error.
+  static bool PRead(int fd, uint64_t offset, char *dst, size_t bytes) {
+    return ParallelIO(bytes, [&](size_t begin, size_t len) {
+      return Transfer(len, [&](size_t done, size_t left) {
+        return pread(fd, dst + begin + done, left, offset + begin + done);
+      });
+    });
+  }
+  static bool PWrite(int fd, uint64_t offset, const char *src, size_t bytes) {
+    return ParallelIO(bytes, [&](size_t begin, size_t len) {
+      return Transfer(len, [&](size_t done, size_t left) {
+        return pwrite(fd, src + begin + done, left, offset + begin + done);
+      });
+    });
+  }
+
+  // Writes a tensor of doubles. With a codec, the compression ratio (payload
+  // size over stored size) is returned in ratio if given.
+  static bool Write(const string &filename, int order, const int64_t dims[3],
+                    const double *data, Codec codec = Raw, double *ratio = nullptr) {
+    return WritePayload(filename, order, dims, sizeof(double),
+                        reinterpret_cast<const char*>(data), codec, ratio);
+  }
+
+  // Writes an opaque byte string
+  static bool WriteBytes(const string &filename, const string &bytes,
+                         Codec codec = Raw, double *ratio = nullptr) {
+    const int64_t dims[3] = {static_cast<int64_t>(bytes.size()), 1, 1};
+    return WritePayload(filename, 1, dims, 1, bytes.data(), codec, ratio);
+  }
+
+  // Reads a byte string written by WriteBytes. Any other file is returned as
+  // it is, so that callers accept both. Throws a message on any error.
+  static string ReadBytes(const string &filename) {
+    if( !IsVersioned(filename) ) {
+      ifstream fin(filename, ios::in | ios::binary);
+      if( !fin ) throw "Failed to open " + filename;
+      return string(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+    }
+    TensorFileHeader header;
+    shared_ptr<char> payload = ReadPayload(filename, header, true);
+    if( header.order != 1 || header.scalar_bytes != 1 )
+      throw "Not a byte string: " + filename;
+    return string(payload.get(), header.payload_bytes);
+  }
+
+  // Maps a versioned file and returns a pointer to its payload, which owns the
+  // mapping. Files written with the other byte order are swapped in the private
+  // mapping, which copies the touched pages. Throws a message on any error.
+  static shared_ptr<double> Map(const string &filename, TensorFileHeader &header,
+                                bool verify = true) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if( fd < 0 ) throw "Failed to open " + filename;
+
+    struct stat st;
+    if( fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(TensorFileHeaderV1) ) {
+      close(fd);
+      throw "Invalid tensor file " + filename;
+    }
+    const size_t file_bytes = st.st_size;
+
+    void *base = mmap(nullptr, file_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( base == MAP_FAILED ) throw "Failed to map " + filename;
+    shared_ptr<char> mapping(static_cast<char*>(base),
+                             [file_bytes](char *p) { munmap(p, file_bytes); });
+
+    const bool swapped = ParseHeader(mapping.get(), file_bytes, filename, header);
+    // compressed files are decompressed into owned storage instead
+    if( header.codec != Raw ) {
+      mapping.reset();
+      return Read(filename, header, verify);
+    }
+    if( header.scalar_bytes != sizeof(double) ) throw "Not a tensor file: " + filename;
+    char *payload = mapping.get() + header.payload_offset;
+    if( verify && Checksum(payload, header.payload_bytes, header.checksum_block)
+                  != header.checksum )
+      throw "Checksum mismatch in tensor file " + filename;
+
+    double *values = reinterpret_cast<double*>(payload);
+    if( swapped ) SwapPayload(values, header.payload_bytes / 8);
+
+    return shared_ptr<double>(mapping, values);
+  }
+
+  // Reads a versioned file into freshly allocated, 64-byte aligned storage
+  // with parallel positional reads, decompressing it if needed. Throws a
+  // message on any error.
+  static shared_ptr<double> Read(const string &filename, TensorFileHeader &header,
+                                 bool verify = true) {
+    shared_ptr<char> payload = ReadPayload(filename, header, verify);
+    if( header.scalar_bytes != sizeof(double) ) throw "Not a tensor file: " + filename;
+    return shared_ptr<double>(payload, reinterpret_cast<double*>(payload.get()));
+  }
+
+  // Legacy files hold order int dimensions followed by the elements. The
+  // dimensions are read first, then allocate(dims) returns the buffer for the
+  // elements. Throws a message on any error.
+  static void ReadLegacy(const string &filename, int order,
+                         const std::function<double*(const int*)> &allocate) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if( fd < 0 ) throw "Failed to open " + filename;
+    shared_ptr<int> fd_owner(new int(fd), [](int *p) { close(*p); delete p; });
+
+    struct stat st;
+    int dims[3] = {1, 1, 1};
+    const size_t dims_bytes = sizeof(int) * order;
+    if( fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < dims_bytes
+        || !PRead(fd, 0, reinterpret_cast<char*>(dims), dims_bytes) )
+      throw "Invalid tensor file " + filename;
+    const uint64_t payload_bytes = sizeof(double)
+                                 * static_cast<uint64_t>(dims[0]) * dims[1] * dims[2];
+    if( dims[0] < 0 || dims[1] < 0 || dims[2] < 0
+        || static_cast<uint64_t>(st.st_size) < dims_bytes + payload_bytes )
+      throw "Corrupted tensor file " + filename;
+
+    double *values = allocate(dims);
+    if( !PRead(fd, dims_bytes, reinterpret_cast<char*>(values), payload_bytes) )
+      throw "Failed to read " + filename;
+  }
+
+  static bool WriteLegacy(const string &filename, int order, const int dims[3],
+                          const double *data) {
+    const size_t dims_bytes = sizeof(int) * order;
+    const uint64_t payload_bytes = sizeof(double)
+                                 * static_cast<uint64_t>(dims[0]) * dims[1] * dims[2];
+    string tmpname;
+    int fd = OpenTemporary(filename, tmpname);
+    if( fd < 0 ) return false;
+    bool ok = ftruncate(fd, dims_bytes + payload_bytes) == 0
+           && PWrite(fd, 0, reinterpret_cast<const char*>(dims), dims_bytes)
+           && PWrite(fd, dims_bytes, reinterpret_cast<const char*>(data), payload_bytes);
+    return ReplaceWithTemporary(fd, ok, tmpname, filename);
+  }
+
+  // Storage aligned for the payload, n elements
+  static shared_ptr<double> Allocate(size_t n) {
+    if( n == 0 ) return shared_ptr<double>();
+    void *p = nullptr;
+    if( posix_memalign(&p, TensorFileHeader::kPayloadAlignment, sizeof(double) * n) != 0 )
+      throw std::bad_alloc();
+    return shared_ptr<double>(static_cast<double*>(p), [](double *p){ free(p); });
+  }
+
+private:
+  static uint64_t CombineChecksums(const vector<uint64_t> &hs) {
+    if( hs.size() == 1 ) return hs[0];
+    return Checksum(reinterpret_cast<const char*>(hs.data()), sizeof(uint64_t) * hs.size());
+  }
+
+  static shared_ptr<char> AllocateBytes(size_t bytes) {
+    shared_ptr<double> p = Allocate((bytes + 7) / 8);
+    return shared_ptr<char>(p, reinterpret_cast<char*>(p.get()));
+  }
+
+  // A file being written may be mapped by a tensor that is read from it, so
+  // it is never truncated in place. The data goes to a temporary file in the
+  // same directory, which replaces the target once it is complete; the old
+  // contents stay alive for as long as they are mapped.
+  static int OpenTemporary(const string &filename, string &tmpname) {
+    vector<char> name(filename.begin(), filename.end());
+    const char suffix[] = ".XXXXXX";
+    name.insert(name.end(), suffix, suffix + sizeof(suffix));
+    int fd = mkstemp(name.data());
+    if( fd < 0 ) return fd;
+    tmpname = name.data();
+    // mkstemp creates the file private; it takes the mode of the file it
+    // replaces, or the mode open would give a new file
+    struct stat st;
+    mode_t mode;
+    if( stat(filename.c_str(), &st) == 0 ) mode = st.st_mode & 07777;
+    else {
+      const mode_t mask = umask(0);
+      umask(mask);
+      mode = 0666 & ~mask;
+    }
+    if( fchmod(fd, mode) != 0 ) {
+      close(fd);
+      unlink(tmpname.c_str());
+      return -1;
+    }
+    return fd;
+  }
+
+  // Flushes and closes the temporary file and moves it over filename, or
+  // removes it when anything failed. The data reaches the disk before the
+  // rename, so a crash cannot leave the target replaced by a partial file.
+  static bool ReplaceWithTemporary(int fd, bool ok, const string &tmpname,
+                                   const string &filename) {
+    ok = ok && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    if( ok && std::rename(tmpname.c_str(), filename.c_str()) == 0 ) return true;
+    unlink(tmpname.c_str());
+    return false;
+  }
+
+  static bool WritePayload(const string &filename, int order, const int64_t dims[3],
+                           size_t scalar_bytes, const char *data, Codec codec,
+                           double *ratio) {
+    TensorFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, Magic(), 8);
+    header.version = TensorFileHeader::kVersion;
+    header.byte_order = TensorFileHeader::kByteOrderMark;
+    header.order = order;
+    header.scalar_bytes = scalar_bytes;
+    for(int i=0;i<3;++i) header.dims[i] = dims[i];
+    header.payload_offset = sizeof(TensorFileHeader);
+    header.payload_bytes = scalar_bytes
+                         * static_cast<uint64_t>(dims[0]) * dims[1] * dims[2];
+    header.checksum_block = kChunkBytes;
+    header.checksum = Checksum(data, header.payload_bytes, header.checksum_block);
+    header.codec = codec;
+    header.stored_bytes = header.payload_bytes;
+
+    // compress every chunk, the chunk table goes first
+    const size_t chunk = kChunkBytes;
+    const long nchunks = static_cast<long>((header.payload_bytes + chunk - 1) / chunk);
+    vector<uint64_t> sizes;
+    vector<vector<char>> blocks;
+    if( codec == ShuffleLZ ) {
+      sizes.resize(nchunks);
+      blocks.resize(nchunks);
+      #pragma omp parallel for schedule(dynamic)
+      for(long c=0;c<nchunks;++c) {
+        const char *src = data + c * chunk;
+        const size_t len = std::min<uint64_t>(chunk, header.payload_bytes - c * chunk);
+        vector<char> planes(len);
+        TensorCodec::Shuffle(src, len / scalar_bytes, scalar_bytes, planes.data());
+        blocks[c].resize(TensorCodec::CompressBound(len));
+        size_t n = TensorCodec::Compress(planes.data(), len, blocks[c].data());
+        if( n >= len ) blocks[c].assign(src, src + len);
+        else blocks[c].resize(n);
+        sizes[c] = blocks[c].size();
+      }
+      header.stored_bytes = sizeof(uint64_t) * nchunks;
+      for(long c=0;c<nchunks;++c) header.stored_bytes += sizes[c];
+    }
+    else if( codec != Raw ) return false;
+    if( ratio ) {
+      *ratio = (header.stored_bytes > 0)?
+               static_cast<double>(header.payload_bytes) / header.stored_bytes:1.0;
+    }
+
+    string tmpname;
+    int fd = OpenTemporary(filename, tmpname);
+    if( fd < 0 ) return false;
+    // the file is sized up front so that the chunks are written independently
+    bool ok = ftruncate(fd, header.payload_offset + header.stored_bytes) == 0
+           && PWrite(fd, 0, reinterpret_cast<const char*>(&header), sizeof(header));
+    if( ok && codec == Raw ) {
+      ok = PWrite(fd, header.payload_offset, data, header.payload_bytes);
+    }
+    else if( ok ) {
+      ok = PWrite(fd, header.payload_offset, reinterpret_cast<const char*>(sizes.data()),
+                  sizeof(uint64_t) * nchunks);
+      vector<uint64_t> offsets(nchunks);
+      uint64_t offset = header.payload_offset + sizeof(uint64_t) * nchunks;
+      for(long c=0;c<nchunks;++c) {
+        offsets[c] = offset;
+        offset += sizes[c];
+      }
+      std::atomic<bool> blocks_ok(true);
+      #pragma omp parallel for schedule(dynamic)
+      for(long c=0;c<nchunks;++c) {
+        if( !PWrite(fd, offsets[c], blocks[c].data(), sizes[c]) ) blocks_ok = false;
+      }
+      ok = ok && blocks_ok;
+    }
+    return ReplaceWithTemporary(fd, ok, tmpname, filename);
+  }
+
+  // Reads and checks the payload of a versioned file into aligned storage,
+  // swapped to the native byte order
+  static shared_ptr<char> ReadPayload(const string &filename, TensorFileHeader &header,
+                                      bool verify) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if( fd < 0 ) throw "Failed to open " + filename;
+    shared_ptr<int> fd_owner(new int(fd), [](int *p) { close(*p); delete p; });
+
+    struct stat st;
+    if( fstat(fd, &st) != 0 ) throw "Invalid tensor file " + filename;
+    const size_t file_bytes = st.st_size;
+
+    char raw[sizeof(TensorFileHeader)];
+    const size_t raw_bytes = std::min(file_bytes, sizeof(raw));
+    if( !PRead(fd, 0, raw, raw_bytes) ) throw "Failed to read " + filename;
+    const bool swapped = ParseHeader(raw, file_bytes, filename, header);
+
+    shared_ptr<char> payload = AllocateBytes(header.payload_bytes);
+    if( header.codec == Raw ) {
+      if( !PRead(fd, header.payload_offset, payload.get(), header.payload_bytes) )
+        throw "Failed to read " + filename;
+      if( verify && Checksum(payload.get(), header.payload_bytes, header.checksum_block)
+                    != header.checksum )
+        throw "Checksum mismatch in tensor file " + filename;
+    }
+    else {
+      vector<char> stored(header.stored_bytes);
+      if( !PRead(fd, header.payload_offset, stored.data(), header.stored_bytes) )
+        throw "Failed to read " + filename;
+      Decompress(stored, header, swapped, verify, payload.get(), filename);
+    }
+
+    if( swapped && header.scalar_bytes == 8 ) {
+      SwapPayload(reinterpret_cast<double*>(payload.get()), header.payload_bytes / 8);
+    }
+    return payload;
+  }
+
+  // Decompresses the chunks in parallel straight into dst, checking each
+  // chunk while it is still in cache
+  static void Decompress(const vector<char> &stored, const TensorFileHeader &header,
+                         bool swapped, bool verify, char *dst, const string &filename) {
+    const size_t chunk = header.checksum_block;
+    const long nchunks = static_cast<long>((header.payload_bytes + chunk - 1) / chunk);
+    if( stored.size() < sizeof(uint64_t) * nchunks ) throw "Corrupted tensor file " + filename;
+
+    vector<uint64_t> sizes(nchunks), offsets(nchunks);
+    memcpy(sizes.data(), stored.data(), sizeof(uint64_t) * nchunks);
+    uint64_t offset = sizeof(uint64_t) * nchunks;
+    for(long c=0;c<nchunks;++c) {
+      if( swapped ) Swap8(&sizes[c]);
+      offsets[c] = offset;
+      offset += sizes[c];
+      if( sizes[c] > stored.size() || offset > stored.size() )
+        throw "Corrupted tensor file " + filename;
+    }
+
+    vector<uint64_t> hs(nchunks);
+    std::atomic<bool> ok(true);
+    #pragma omp parallel for schedule(dynamic)
+    for(long c=0;c<nchunks;++c) {
+      const size_t len = std::min<uint64_t>(chunk, header.payload_bytes - c * chunk);
+      const char *src = stored.data() + offsets[c];
+      char *out = dst + c * chunk;
+      if( sizes[c] == len ) memcpy(out, src, len);
+      else {
+        vector<char> planes(len);
+        if( !TensorCodec::Decompress(src, sizes[c], planes.data(), len) ) {
+          ok = false;
+          continue;
+        }
+        TensorCodec::Unshuffle(planes.data(), len / header.scalar_bytes,
+                               header.scalar_bytes, out);
+      }
+      if( verify ) hs[c] = Checksum(out, len);
+    }
+    if( !ok ) throw "Corrupted tensor file " + filename;
+    if( verify && nchunks > 0 && CombineChecksums(hs) != header.checksum )
+      throw "Checksum mismatch in tensor file " + filename;
+  }
+
+  template <typename F>
+  static bool ParallelIO(size_t bytes, const F &chunk_io) {
+    const size_t chunk = kChunkBytes;
+    const long nchunks = static_cast<long>((bytes + chunk - 1) / chunk);
+    std::atomic<bool> ok(true);
+    #pragma omp parallel for schedule(dynamic) if(nchunks > 1)
+    for(long c=0;c<nchunks;++c) {
+      const size_t begin = c * chunk;
+      if( ok && !chunk_io(begin, std::min(chunk, bytes - begin)) ) ok = false;
+    }
+    return ok;
+  }
+
+  template <typename F>
+  static bool Transfer(size_t bytes, const F &io) {
+    size_t done = 0;
+    while( done < bytes ) {
+      ssize_t n = io(done, bytes - done);
+      if( n < 0 && errno == EINTR ) continue;
+      if( n <= 0 ) return false;
+      done += n;
+    }
+    return true;
+  }
+
+  // Validates the header at the start of a file and converts it to the
+  // current version. Returns whether the payload needs byte swapping.
+  static bool ParseHeader(const char *raw, size_t file_bytes, const string &filename,
+                          TensorFileHeader &header) {
+    // the fields up to the scalar size are shared by every version
+    if( file_bytes < sizeof(TensorFileHeaderV1) ) throw "Invalid tensor file " + filename;
+    memset(&header, 0, sizeof(header));
+    memcpy(&header, raw, 24);
+    const bool swapped = (header.byte_order != TensorFileHeader::kByteOrderMark);
+    if( swapped ) {
+      Swap4(&header.version); Swap4(&header.byte_order); Swap4(&header.order);
+      Swap4(&header.scalar_bytes);
+    }
+    if( memcmp(header.magic, Magic(), 8) != 0
+        || header.byte_order != TensorFileHeader::kByteOrderMark )
+      throw "Invalid tensor file " + filename;
+
+    if( header.version == 1 ) {
+      TensorFileHeaderV1 v1;
+      memcpy(&v1, raw, sizeof(v1));
+      if( swapped ) {
+        for(int i=0;i<3;++i) Swap4(&v1.dims[i]);
+        Swap8(&v1.payload_offset); Swap8(&v1.payload_bytes); Swap8(&v1.checksum);
+      }
+      for(int i=0;i<3;++i) header.dims[i] = v1.dims[i];
+      header.payload_offset = v1.payload_offset;
+      header.payload_bytes = v1.payload_bytes;
+      header.checksum = v1.checksum;
+      header.checksum_block = ~uint64_t(7);     // a single block
+    }
+    else if( header.version == TensorFileHeader::kVersion ) {
+      if( file_bytes < sizeof(header) ) throw "Invalid tensor file " + filename;
+      memcpy(&header, raw, sizeof(header));
+      if( swapped ) SwapHeader(header);
+    }
+    else throw "Unsupported tensor file version " + to_string(header.version);
+
+    const bool dims_valid = header.dims[0] >= 0 && header.dims[1] >= 0 && header.dims[2] >= 0;
+    const bool scalar_valid = header.scalar_bytes == sizeof(double)
+                           || (header.scalar_bytes == 1 && header.order == 1);
+    if( header.codec != Raw && header.codec != ShuffleLZ )
+      throw "Unsupported codec in tensor file " + filename;
+    const uint64_t stored_bytes = (header.codec == Raw)?header.payload_bytes
+                                                        :header.stored_bytes;
+    if( !dims_valid || !scalar_valid
+        || header.checksum_block == 0 || header.checksum_block % 8 != 0
+        || header.payload_offset % TensorFileHeader::kPayloadAlignment != 0
+        || header.payload_offset + stored_bytes > file_bytes
+        || header.payload_bytes != header.scalar_bytes * static_cast<uint64_t>(header.dims[0])
+                                   * header.dims[1] * header.dims[2] )
+      throw "Corrupted tensor file " + filename;
+    return swapped;
+  }
+
+  template <typename T>
+  static void Swap4(T *v) {
+    static_assert(sizeof(T) == 4, "");
+    char *b = reinterpret_cast<char*>(v);
+    std::swap(b[0], b[3]); std::swap(b[1], b[2]);
+  }
+
+  template <typename T>
+  static void Swap8(T *v) {
+    static_assert(sizeof(T) == 8, "");
+    char *b = reinterpret_cast<char*>(v);
+    std::swap(b[0], b[7]); std::swap(b[1], b[6]);
+    std::swap(b[2], b[5]); std::swap(b[3], b[4]);
+  }
+
+  static void SwapHeader(TensorFileHeader &h) {
+    Swap4(&h.version); Swap4(&h.byte_order); Swap4(&h.order);
+    Swap4(&h.scalar_bytes);
+    for(int i=0;i<3;++i) Swap8(&h.dims[i]);
+    Swap8(&h.payload_offset); Swap8(&h.payload_bytes); Swap8(&h.checksum);
+    Swap8(&h.checksum_block);
+    Swap4(&h.codec); Swap8(&h.stored_bytes);
+  }
+
+  static void SwapPayload(double *values, size_t n) {
+    #pragma omp parallel for
+    for(long i=0;i<static_cast<long>(n);++i) Swap8(values + i);
+  }
+};
+
+#endif // TENSORFILE_HPP
@@ -0,0 +1,389 @@
+#include "../multilinearmodel.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <functional>
+#include <iomanip>
+#include <random>
+
+// Microbenchmarks of the tensor kernels at production sizes, on a synthetic
+// random tensor.
+//
+// Usage: bench_tensors [--csv] [layers rows cols [repeats]]
+//
+// Without a size, every production size is measured in turn:
+//   core       50x25x34530    the multilinear model core
+//   landmarks  50x25x3        the core restricted to one landmark
+//   builder    150x47x34530   the blend shape tensor of the model builder
+//
+// Besides the Tensor3 kernels, the vector mode products are measured on the
+// fp16 and int8 cores, and MultilinearModel's batched evaluation against one
+// evaluation per weight pair.
+//
+// For each kernel the report has the time per call, GFLOP/s, GB/s and the
+// number and size of the heap allocations per call. --csv prints the same
+// columns as comma separated values for scripts.
+//
+// The flop and byte counts are nominal: one multiply-add is 2 flops, and the
+// bytes are the minimal traffic of the kernel, i.e. each input and output
+// element moved once.
+
+// Heap allocation counters. On glibc every allocation, including the
+// posix_memalign of the tensor storage and Eigen's malloc, goes through the
+// malloc family, which is interposed here.
+namespace {
+  std::atomic<size_t> alloc_count(0), alloc_bytes(0);
+}
+
+#if defined(__GLIBC__)
+extern "C" {
+  void *__libc_malloc(size_t);
+  void *__libc_calloc(size_t, size_t);
+  void *__libc_realloc(void*, size_t);
+  void *__libc_memalign(size_t, size_t);
+  void __libc_free(void*);
+
+  void *malloc(size_t n) {
+    alloc_count++; alloc_bytes += n;
+    return __libc_malloc(n);
+  }
+  void *calloc(size_t k, size_t n) {
+    alloc_count++; alloc_bytes += k * n;
+    return __libc_calloc(k, n);
+  }
+  void *realloc(void *p, size_t n) {
+    alloc_count++; alloc_bytes += n;
+    return __libc_realloc(p, n);
+  }
+  void *memalign(size_t a, size_t n) {
+    alloc_count++; alloc_bytes += n;
+    return __libc_memalign(a, n);
+  }
+  void *aligned_alloc(size_t a, size_t n) {
+    alloc_count++; alloc_bytes += n;
+    return __libc_memalign(a, n);
+  }
+  int posix_memalign(void **p, size_t a, size_t n) {
+    alloc_count++; alloc_bytes += n;
+    *p = __libc_memalign(a, n);
+    return (*p == nullptr)?ENOMEM:0;
+  }
+  void free(void *p) { __libc_free(p); }
+}
+#define ALLOCATIONS_COUNTED 1
+#else
+#define ALLOCATIONS_COUNTED 0
+#endif
+
+namespace {
+  struct Measurement {
+    double seconds;         // best time of one call
+    double allocs;          // heap allocations per call
+    double alloc_bytes;     // bytes allocated per call
+  };
+
+  // Swallows the progress messages of Read/Write while timing
+  struct NullBuffer : public std::streambuf {
+    int overflow(int c) { return c; }
+  };
+
+  bool csv = false;
+
+  Tensor3 RandomTensor(int l, int m, int n) {
+    Tensor3 t(l, m, n);
+    std::mt19937 gen(0);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    for(size_t i=0;i<t.size();++i) t.rawptr()[i] = dist(gen);
+    return t;
+  }
+
+  Tensor2 RandomMatrix(int m, int n) {
+    return Tensor2(MatrixXd::Random(m, n));
+  }
+
+  // Runs f once to warm up, then repeats batches of calls long enough to be
+  // timed reliably, and keeps the best batch.
+  Measurement Measure(const std::function<void()> &f, int repeats) {
+    NullBuffer null_buffer;
+    std::streambuf *cout_buffer = cout.rdbuf(&null_buffer);
+
+    auto t0 = chrono::steady_clock::now();
+    f();
+    double first = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    const int calls = std::max(1, std::min(100000, static_cast<int>(0.01 / std::max(first, 1e-9))));
+
+    Measurement res = {1e30, 0, 0};
+    alloc_count = 0; alloc_bytes = 0;
+    for(int r=0;r<repeats;++r) {
+      auto t1 = chrono::steady_clock::now();
+      for(int i=0;i<calls;++i) f();
+      auto t2 = chrono::steady_clock::now();
+      res.seconds = std::min(res.seconds, chrono::duration<double>(t2 - t1).count() / calls);
+    }
+    res.allocs = static_cast<double>(alloc_count) / (repeats * calls);
+    res.alloc_bytes = static_cast<double>(alloc_bytes) / (repeats * calls);
+
+    cout.rdbuf(cout_buffer);
+    return res;
+  }
+
+  void PrintHeader() {
+    if( csv ) {
+      cout << "size,kernel,ns_per_op,gflops,gbps,allocs_per_op,alloc_bytes_per_op" << endl;
+      return;
+    }
+    cout << std::left << std::setw(10) << "size" << std::setw(14) << "kernel"
+         << std::right << std::setw(16) << "ns/op" << std::setw(10) << "GFLOP/s"
+         << std::setw(10) << "GB/s" << std::setw(10) << "allocs"
+         << std::setw(14) << "alloc bytes" << endl;
+  }
+
+  void Report(const string &size, const string &name, const Measurement &m,
+              double flops, double bytes) {
+    const double allocs = ALLOCATIONS_COUNTED?m.allocs:-1;
+    const double abytes = ALLOCATIONS_COUNTED?m.alloc_bytes:-1;
+    if( csv ) {
+      cout << size << "," << name << "," << m.seconds * 1e9 << ","
+           << flops / m.seconds * 1e-9 << "," << bytes / m.seconds * 1e-9 << ","
+           << allocs << "," << abytes << endl;
+      return;
+    }
+    cout << std::left << std::setw(10) << size << std::setw(14) << name
+         << std::right << std::fixed << std::setprecision(0)
+         << std::setw(16) << m.seconds * 1e9
+         << std::setprecision(2)
+         << std::setw(10) << flops / m.seconds * 1e-9
+         << std::setw(10) << bytes / m.seconds * 1e-9
+         << std::setw(10) << allocs
+         << std::setprecision(0) << std::setw(14) << abytes << endl;
+  }
+
+  // Benchmarks every kernel on one l x m x n tensor, returns false if a
+  // kernel gives a wrong result
+  bool Run(const string &label, int l, int m, int n, int repeats) {
+    Tensor3 t = RandomTensor(l, m, n);
+    const double N = t.size();
+    const int dims[3] = {l, m, n};
+
+    // unfoldings: read and write every element once
+    for(int mode=0;mode<3;++mode) {
+      // the first call allocates, the timed ones reuse the buffer
+      Tensor2 tu = t.Unfold(mode);
+      auto tu_time = Measure([&]() {
+        switch(mode) {
+        case 0: t.Unfold<0>(tu); break;
+        case 1: t.Unfold<1>(tu); break;
+        case 2: t.Unfold<2>(tu); break;
+        }
+      }, repeats);
+      Report(label, "Unfold<" + to_string(mode) + ">", tu_time, 0, 16 * N);
+
+      Tensor3 tf(l, m, n);
+      auto tf_time = Measure([&]() {
+        switch(mode) {
+        case 0: Tensor3::Fold<0>(tu, l, m, n, tf); break;
+        case 1: Tensor3::Fold<1>(tu, l, m, n, tf); break;
+        case 2: Tensor3::Fold<2>(tu, l, m, n, tf); break;
+        }
+      }, repeats);
+      Report(label, "Fold<" + to_string(mode) + ">", tf_time, 0, 16 * N);
+
+      if( tf != t ) {
+        cerr << "Mode " << mode << " fold/unfold round trip failed." << endl;
+        return false;
+      }
+    }
+
+    // vector mode products in double and mixed precision, dominated by
+    // reading the tensor once
+    Tensor3f t_f(t);
+    for(int mode=0;mode<3;++mode) {
+      Tensor1 v = Tensor1::Random(dims[mode]);
+      Tensor2 A;
+      const double out = N / dims[mode];
+      auto d_time = Measure([&]() {
+        switch(mode) {
+        case 0: t.ModeProduct<0>(v, A); break;
+        case 1: t.ModeProduct<1>(v, A); break;
+        case 2: t.ModeProduct<2>(v, A); break;
+        }
+      }, repeats);
+      Report(label, "TV<" + to_string(mode) + ">", d_time, 2 * N, 8 * (N + out));
+
+      auto f_time = Measure([&]() {
+        switch(mode) {
+        case 0: t_f.ModeProduct<0>(v, A); break;
+        case 1: t_f.ModeProduct<1>(v, A); break;
+        case 2: t_f.ModeProduct<2>(v, A); break;
+        }
+      }, repeats);
+      Report(label, "TV<" + to_string(mode) + ">f", f_time, 2 * N, 4 * N + 8 * out);
+    }
+
+    // vector mode products on the quantized cores, which read 2 or 1 bytes per
+    // element plus the scale and offset of every (layer, row) slice
+    {
+      Tensor3h t_h(t);
+      Tensor3i8 t_i8(t);
+      for(int mode=0;mode<2;++mode) {
+        Tensor1 v = Tensor1::Random(dims[mode]);
+        Tensor2 A;
+        const double out = N / dims[mode], params = 16.0 * l * m;
+        auto h_time = Measure([&]() {
+          if( mode == 0 ) t_h.ModeProduct<0>(v, A); else t_h.ModeProduct<1>(v, A);
+        }, repeats);
+        Report(label, "TV<" + to_string(mode) + ">h", h_time, 2 * N, 2 * N + params + 8 * out);
+        auto i8_time = Measure([&]() {
+          if( mode == 0 ) t_i8.ModeProduct<0>(v, A); else t_i8.ModeProduct<1>(v, A);
+        }, repeats);
+        Report(label, "TV<" + to_string(mode) + ">i8", i8_time, 2 * N, N + params + 8 * out);
+      }
+    }
+
+    // the transposed mode 1 product on the mode-1 view, as in MultilinearModel
+    {
+      Tensor2 At;
+      Tensor1 v = Tensor1::Random(m);
+      auto time = Measure([&]() { t.TransposedModeProduct1(v, At); }, repeats);
+      Report(label, "TV<1>t", time, 2 * N, 8 * (N + N / m));
+    }
+
+    // matrix mode products, reducing modes 0 and 1 by the builder's ratios
+    // and mode 2 to at most 64 columns
+    const int ranks[3] = {std::max(1, l / 3), std::max(1, (m + 1) / 2), std::min(n, 64)};
+    for(int mode=0;mode<3;++mode) {
+      Tensor2 A = RandomMatrix(ranks[mode], dims[mode]);
+      Tensor3 res;
+      const double out = N / dims[mode] * ranks[mode];
+      auto time = Measure([&]() {
+        switch(mode) {
+        case 0: t.ModeProduct<0>(A, res); break;
+        case 1: t.ModeProduct<1>(A, res); break;
+        case 2: t.ModeProduct<2>(A, res); break;
+        }
+      }, repeats);
+      Report(label, "TM<" + to_string(mode) + ">", time, 2 * N * ranks[mode],
+             8 * (N + out + static_cast<double>(ranks[mode]) * dims[mode]));
+    }
+
+    // truncated HOSVD over the first two modes, as in the model builder. The
+    // count covers the two Gram matrices and the two projections, which read
+    // the tensor three times.
+    {
+      vector<int> modes = {0, 1};
+      vector<int> ranks01 = {ranks[0], ranks[1]};
+      auto time = Measure([&]() { t.svd(modes, ranks01, Tensor3::Auto); }, repeats);
+      const double flops = N * (l + m) + 2 * N * ranks[0]
+                         + 2 * (N / l) * ranks[0] * ranks[1];
+      Report(label, "svd", time, flops, 3 * 8 * N);
+    }
+
+    // file io through the page cache
+    const string filename = "bench_tensors_" + label + ".tensor";
+    for(int legacy=0;legacy<2;++legacy) {
+      const string suffix = legacy?"legacy":"";
+      auto w_time = Measure([&]() { t.Write(filename, legacy); }, repeats);
+      Report(label, "Write" + suffix, w_time, 0, 8 * N);
+
+      // Read copies the payload into memory with pread. A mapped read only
+      // verifies the checksum of the mapped pages, which mostly measures the
+      // checksum over the page cache; legacy files are never mapped.
+      Tensor3 tin;
+      auto r_time = Measure([&]() { tin.Read(filename, false); }, repeats);
+      Report(label, "Read" + suffix, r_time, 0, 8 * N);
+      if( !legacy ) {
+        Tensor3 tmap;
+        auto m_time = Measure([&]() { tmap.Read(filename); }, repeats);
+        Report(label, "ReadMap", m_time, 0, 8 * N);
+      }
+
+      if( tin != t ) {
+        cerr << "Read back " << filename << " differs from the tensor written." << endl;
+        std::remove(filename.c_str());
+        return false;
+      }
+    }
+
+    // compressed container; random data is close to incompressible, so this
+    // mostly measures the codec overhead
+    {
+      auto w_time = Measure([&]() { t.WriteCompressed(filename); }, repeats);
+      Report(label, "WriteLZ", w_time, 0, 8 * N);
+
+      Tensor3 tin;
+      auto r_time = Measure([&]() { tin.Read(filename, false); }, repeats);
+      Report(label, "ReadLZ", r_time, 0, 8 * N);
+
+      if( tin != t ) {
+        cerr << "Read back " << filename << " differs from the tensor written." << endl;
+        std::remove(filename.c_str());
+        return false;
+      }
+    }
+
+    // the model evaluations on the tensor as a core: 64 weight pairs over 8
+    // identities, one at a time and batched
+    {
+      NullBuffer null_buffer;
+      std::streambuf *cout_buffer = cout.rdbuf(&null_buffer);
+      t.Write(filename);
+      MultilinearModel model(filename);
+      cout.rdbuf(cout_buffer);
+      const int npairs = 64, nids = 8;
+      MatrixXd ids = MatrixXd::Random(l, nids), W0(l, npairs), W1 = MatrixXd::Random(m, npairs);
+      for(int b=0;b<npairs;++b) W0.col(b) = ids.col(b % nids);
+      const double flops = 2 * N * nids + 2.0 * m * n * npairs;
+
+      MatrixXd TM(n, npairs), TMb;
+      MultilinearModel::Workspace ws;
+      auto p_time = Measure([&]() {
+        for(int b=0;b<npairs;++b) {
+          model.ApplyWeights(W0.col(b), W1.col(b), ws);
+          TM.col(b) = ws.tm;
+        }
+      }, repeats);
+      Report(label, "ApplyW", p_time, 2 * N * npairs + 2.0 * m * n * npairs, 8 * N * npairs);
+
+      auto b_time = Measure([&]() { model.ApplyWeightsBatch(W0, W1, TMb); }, repeats);
+      Report(label, "ApplyWB", b_time, flops, 8 * (N + static_cast<double>(n) * npairs));
+
+      if( (TMb - TM).norm() > 1e-8 * TM.norm() ) {
+        cerr << "Batched evaluation differs from the per pair one." << endl;
+        std::remove(filename.c_str());
+        return false;
+      }
+    }
+    std::remove(filename.c_str());
+
+    return true;
+  }
+}
+
+int main(int argc, char **argv) {
+  int argi = 1;
+  if( argc > 1 && string(argv[1]) == "--csv" ) {
+    csv = true;
+    ++argi;
+  }
+
+  struct Size { string label; int l, m, n; };
+  vector<Size> sizes = {
+    {"core", 50, 25, 34530},
+    {"landmarks", 50, 25, 3},
+    {"builder", 150, 47, 34530}
+  };
+  int repeats = 5;
+  if( argc - argi >= 3 ) {
+    sizes = {{"custom", atoi(argv[argi]), atoi(argv[argi+1]), atoi(argv[argi+2])}};
+  }
+  if( argc - argi >= 4 ) repeats = atoi(argv[argi+3]);
+
+  PrintHeader();
+  for(const Size &s : sizes) {
+    if( !csv ) cout << "tensor size = " << s.l << "x" << s.m << "x" << s.n << endl;
+    if( !Run(s.label, s.l, s.m, s.n, repeats) ) return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,438 @@
+#define CATCH_CONFIG_MAIN
+#include "../third_party/Catch/include/catch.hpp"
+
+#include "../multilinearmodel.h"
+
+#include <random>
+
+namespace {
+  // A model with a random 50x25x(3*nverts) core
+  MultilinearModel RandomModel(int nverts, int l = 50, int m = 25) {
+    std::mt19937 gen(5);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    Tensor3 core(l, m, nverts * 3);
+    for(size_t i=0;i<core.size();++i) core.rawptr()[i] = dist(gen);
+    const string filename = "test_model.tensor";
+    core.Write(filename);
+    MultilinearModel model(filename);
+    remove(filename.c_str());
+    return model;
+  }
+}
+
+TEST_CASE("Fixed size landmark models", "[MultilinearModel]") {
+  MultilinearModel model = RandomModel(10);
+  MultilinearModel model_i = model.project(vector<int>(1, 7));
+
+  Tensor1 w0 = Tensor1::Random(50), w1 = Tensor1::Random(25);
+  model_i.ApplyWeights(w0, w1);
+
+  FixedModelResults<50, 25, 3> fixed_i(model_i);
+  FixedModelResults<Dynamic, Dynamic, 3> dynamic_i(model_i);
+  fixed_i.CopyTM1(model_i);
+  dynamic_i.CopyTM1(model_i);
+  CHECK( (fixed_i.GetTM() - model_i.GetTM()).norm() < 1e-12 );
+  CHECK( (fixed_i.GetTM0() - model_i.GetTM0().GetData()).norm() < 1e-12 );
+  CHECK( (fixed_i.GetTM1() - model_i.GetTM1().GetData()).norm() < 1e-12 );
+  CHECK( (dynamic_i.GetTM() - model_i.GetTM()).norm() < 1e-12 );
+
+  Tensor1 v0 = Tensor1::Random(50), v1 = Tensor1::Random(25);
+  model_i.UpdateTMWithTM1(v0);
+  fixed_i.UpdateTMWithTM1(v0);
+  dynamic_i.UpdateTMWithTM1(v0);
+  CHECK( (fixed_i.GetTM() - model_i.GetTM()).norm() < 1e-10 );
+  CHECK( (dynamic_i.GetTM() - model_i.GetTM()).norm() < 1e-10 );
+
+  model_i.UpdateTMWithTM0(v1);
+  fixed_i.UpdateTMWithTM0(v1);
+  CHECK( (fixed_i.GetTM() - model_i.GetTM()).norm() < 1e-10 );
+
+  // row vector weights, as in the FACS cost functions
+  RowVectorXd r1 = w1.transpose();
+  model_i.UpdateTMWithTM0(r1);
+  fixed_i.UpdateTMWithTM0(r1);
+  CHECK( (fixed_i.GetTM() - model_i.GetTM()).norm() < 1e-10 );
+
+  typedef FixedModelResults<40, 25, 3> WrongRanks;
+  CHECK_THROWS( WrongRanks(model_i) );
+}
+
+TEST_CASE("Landmark results of any rank", "[MultilinearModel]") {
+  Tensor1 x = Tensor1::Random(46);
+  // the ranks of the fixed-size path, and a core truncated to 40x20
+  const int ranks[][2] = {{50, 25}, {40, 20}};
+  for(auto &r : ranks) {
+    MultilinearModel model_i = RandomModel(10, r[0], r[1]).project(vector<int>(1, 6));
+    Tensor1 w0 = Tensor1::Random(r[0]), w1 = Tensor1::Random(r[1]);
+    model_i.ApplyWeights(w0, w1);
+
+    LandmarkResults<50, 25> landmark(model_i);
+    CHECK( landmark.IsFixedSize() == (r[0] == 50) );
+    CHECK( (landmark.GetTM() - model_i.GetTM()).norm() < 1e-12 );
+    CHECK( (landmark.GetTM0() - model_i.GetTM0().GetData()).norm() < 1e-12 );
+    // tm1 is only copied for the identity evaluations
+    CHECK( landmark.GetTM1().isZero() );
+    landmark.CopyTM1(model_i);
+    CHECK( (landmark.GetTM1() - model_i.GetTM1().GetData()).norm() < 1e-12 );
+
+    Vector3d tm;
+    Tensor1 v0 = Tensor1::Random(r[0]), v1 = Tensor1::Random(r[1]);
+    landmark.EvaluateWithTM0(v1, tm);
+    model_i.UpdateTMWithTM0(v1);
+    CHECK( (tm - model_i.GetTM()).norm() < 1e-10 );
+    landmark.EvaluateWithTM1(v0, tm);
+    model_i.UpdateTMWithTM1(v0);
+    CHECK( (tm - model_i.GetTM()).norm() < 1e-10 );
+
+    MatrixXd Uexp_r = MatrixXd::Random(47, r[1]);
+    VectorXd f(47);
+    f.tail(46) = x;
+    f[0] = 1.0 - x.sum();
+    landmark.SetFACSBasis(Uexp_r);
+    landmark.EvaluateFACS(x, tm);
+    model_i.UpdateTMWithTM0((Uexp_r.transpose() * f).eval());
+    CHECK( (tm - model_i.GetTM()).norm() < 1e-10 );
+  }
+}
+
+TEST_CASE("FACS space evaluation", "[MultilinearModel]") {
+  MultilinearModel model_i = RandomModel(10).project(vector<int>(1, 4));
+  MatrixXd Uexp = MatrixXd::Random(47, 25);
+  Tensor1 w0 = Tensor1::Random(50), x = Tensor1::Random(46);
+  model_i.ApplyWeights(w0, Uexp.row(0).transpose());
+
+  FixedModelResults<50, 25, 3> fixed_i(model_i);
+  fixed_i.SetFACSBasis(Uexp);
+  REQUIRE( fixed_i.GetFACSBasis().cols() == 46 );
+
+  // f = (1 - sum(x), x) through Uexp and tm0
+  VectorXd f(47);
+  f.tail(46) = x;
+  f[0] = 1.0 - x.sum();
+  Vector3d tm, tm_ref;
+  fixed_i.EvaluateFACS(x, tm);
+  fixed_i.EvaluateWithTM0((f.transpose() * Uexp).eval(), tm_ref);
+  CHECK( (tm - tm_ref).norm() < 1e-10 );
+
+  // the basis is the Jacobian with respect to x
+  Vector3d tm_0, tm_k;
+  fixed_i.EvaluateFACS(Tensor1::Zero(46), tm_0);
+  fixed_i.EvaluateFACS(Tensor1::Unit(46, 7), tm_k);
+  CHECK( (tm_k - tm_0 - fixed_i.GetFACSBasis().col(7)).norm() < 1e-10 );
+}
+
+TEST_CASE("Weight application", "[MultilinearModel]") {
+  MultilinearModel model = RandomModel(40);
+  Tensor1 w0 = Tensor1::Random(50), w1 = Tensor1::Random(25);
+  model.ApplyWeights(w0, w1);
+  Tensor2 tm0 = model.GetTM0(), tm1 = model.GetTM1();
+  Tensor1 tm = model.GetTM();
+
+  model.UpdateTM0(w0);
+  model.UpdateTM1(w1);
+  model.UpdateTMWithTM0(w1);
+  CHECK( (tm0 - model.GetTM0()).norm() < 1e-10 );
+  CHECK( (tm1 - model.GetTM1()).norm() < 1e-10 );
+  CHECK( (tm - model.GetTM()).norm() < 1e-10 );
+}
+
+TEST_CASE("Mode 1 product", "[MultilinearModel]") {
+  // distinct sizes, so that a transposed layout cannot pass
+  MultilinearModel model = RandomModel(7, 6, 5);
+  const Tensor3 &core = model.GetCore();
+  Tensor1 w = Tensor1::Random(5);
+
+  // tm1 is kept transposed, in the layout of the core's mode-1 view
+  model.UpdateTM1(w);
+  const Tensor2 &tm1 = model.GetTM1();
+  REQUIRE( tm1.rows() == 21 );
+  REQUIRE( tm1.cols() == 6 );
+  CHECK( (tm1.GetData() - core.ModeProduct<1>(w).GetData().transpose()).norm() < 1e-12 );
+  double max_err = 0;
+  for(int i=0;i<6;++i) {
+    for(int k=0;k<21;++k) {
+      double s = 0;
+      for(int j=0;j<5;++j) s += core(i, j, k) * w(j);
+      max_err = std::max(max_err, std::abs(s - tm1(k, i)));
+    }
+  }
+  CHECK( max_err < 1e-12 );
+
+  // later products are written into the same storage
+  const double *storage = tm1.rawptr();
+  model.UpdateTM1(Tensor1::Random(5));
+  CHECK( model.GetTM1().rawptr() == storage );
+}
+
+TEST_CASE("Incremental weight application", "[MultilinearModel]") {
+  MultilinearModel model = RandomModel(40);
+  const Tensor3 &core = model.GetCore();
+  Tensor1 w0 = Tensor1::Random(50), w1 = Tensor1::Random(25);
+  Tensor1 v0 = Tensor1::Random(50), v1 = Tensor1::Random(25);
+
+  auto check = [&](const Tensor1 &a0, const Tensor1 &a1) {
+    Tensor2 tm0 = core.ModeProduct<0>(a0), tm1 = core.ModeProduct<1>(a1);
+    CHECK( (tm0 - model.GetTM0()).norm() < 1e-10 );
+    CHECK( (tm0.ModeProduct<0>(a1) - model.GetTM()).norm() < 1e-10 );
+    CHECK( (tm1.GetData().transpose() - model.GetTM1().GetData()).norm() < 1e-10 );
+  };
+
+  model.ApplyWeights(w0, w1);
+  check(w0, w1);
+  // expression only, then identity only
+  model.ApplyWeights(w0, v1);
+  check(w0, v1);
+  model.ApplyWeights(v0, v1);
+  check(v0, v1);
+
+  // tm set by the cost function paths is recomputed by the next application
+  model.UpdateTMWithTM1(w0);
+  model.ApplyWeights(v0, v1);
+  check(v0, v1);
+  model.UpdateTM1(w1);
+  model.ApplyWeights(v0, v1);
+  check(v0, v1);
+}
+
+TEST_CASE("Const evaluation with workspaces", "[MultilinearModel]") {
+  MultilinearModel model = RandomModel(40);
+  const int nthreads = 8;
+  MatrixXd W0 = MatrixXd::Random(50, nthreads), W1 = MatrixXd::Random(25, nthreads);
+
+  // one shared model, one workspace per thread
+  vector<MultilinearModel::Workspace> ws(nthreads);
+  #pragma omp parallel for
+  for(int t=0;t<nthreads;++t) model.ApplyWeights(W0.col(t), W1.col(t), ws[t]);
+
+  MultilinearModel model_i = model.project(vector<int>(1, 11));
+  model_i.ApplyWeights(W0.col(0), W1.col(0));
+  // the results held by the cost functions, without the landmark's core
+  using LandmarkModel = FixedModelResults<50, 25, 3>;
+  LandmarkModel landmark(model_i);
+  landmark.CopyTM1(model_i);
+  CHECK( sizeof(LandmarkModel) < sizeof(double) * model_i.GetCore().size() / 4 );
+  vector<LandmarkModel::TMVector> tm0s(nthreads), tm1s(nthreads);
+  #pragma omp parallel for
+  for(int t=0;t<nthreads;++t) {
+    landmark.EvaluateWithTM0(W1.col(t), tm0s[t]);
+  }
+
+  for(int t=0;t<nthreads;++t) {
+    model.ApplyWeights(W0.col(t), W1.col(t));
+    CHECK( (ws[t].tm0 - model.GetTM0()).norm() < 1e-10 );
+    CHECK( (ws[t].tm - model.GetTM()).norm() < 1e-10 );
+
+    model_i.UpdateTMWithTM0(W1.col(t));
+    CHECK( (tm0s[t] - model_i.GetTM()).norm() < 1e-10 );
+  }
+
+  // the identity path, from the tm1 of the first pair
+  landmark.EvaluateWithTM1(W0.col(1), tm1s[1]);
+  model_i.UpdateTMWithTM1(W0.col(1));
+  CHECK( (tm1s[1] - model_i.GetTM()).norm() < 1e-10 );
+}
+
+TEST_CASE("Batched weight application", "[MultilinearModel]") {
+  MultilinearModel model = RandomModel(40);
+  // 4 identities shared by 13 pairs, in no particular order
+  MatrixXd ids = MatrixXd::Random(50, 4);
+  MatrixXd W0(50, 13), W1 = MatrixXd::Random(25, 13);
+  for(int b=0;b<13;++b) W0.col(b) = ids.col((b * 7) % 4);
+
+  MultilinearModel::Precision precisions[] = {MultilinearModel::Double,
+                                              MultilinearModel::Mixed};
+  for(auto p : precisions) {
+    model.SetPrecision(p);
+    MatrixXd TM;
+    model.ApplyWeightsBatch(W0, W1, TM);
+    REQUIRE( TM.rows() == 120 );
+    REQUIRE( TM.cols() == 13 );
+    for(int b=0;b<13;++b) {
+      model.ApplyWeights(W0.col(b), W1.col(b));
+      CHECK( (TM.col(b) - model.GetTM()).norm() < 1e-10 );
+    }
+  }
+}
+
+TEST_CASE("Batched vertex projection", "[MultilinearModel]") {
+  MultilinearModel model = RandomModel(40);
+  vector<int> indices{3, 17, 0, 39, 17};
+  vector<MultilinearModel> models = model.projectEach(indices);
+  REQUIRE( models.size() == indices.size() );
+
+  MultilinearModel model_all = model.project(indices);
+  Tensor1 w0 = Tensor1::Random(50), w1 = Tensor1::Random(25);
+  model_all.ApplyWeights(w0, w1);
+  for(size_t k=0;k<indices.size();++k) {
+    MultilinearModel model_k = model.project(vector<int>(1, indices[k]));
+    CHECK( (models[k].GetCore().Flatten() - model_k.GetCore().Flatten()).norm() == 0 );
+    CHECK( reinterpret_cast<uintptr_t>(models[k].GetCore().rawptr()) % Tensor3::kAlignment == 0 );
+
+    models[k].ApplyWeights(w0, w1);
+    CHECK( (models[k].GetTM() - model_all.GetTM().segment(3 * k, 3)).norm() < 1e-10 );
+  }
+
+  // the cores are slots of one block, shared by copies of the models
+  CHECK( models[1].GetCore().rawptr() > models[0].GetCore().rawptr() );
+  MultilinearModel copy = models[0];
+  CHECK( copy.GetCore().rawptr() == models[0].GetCore().rawptr() );
+}
+
+TEST_CASE("Projected vertex cache", "[MultilinearModel]") {
+  MultilinearModel model = RandomModel(40);
+  MultilinearModel copy = model;
+  CHECK( model.CachedProjections() == 0 );
+
+  model.PreloadProjections(vector<int>{5, 9, 5});
+  CHECK( copy.CachedProjections() == 2 );
+
+  // lookups from several threads, hits and misses
+  vector<MultilinearModel> models(40);
+  #pragma omp parallel for
+  for(int v=0;v<40;++v) models[v] = copy.projected(v);
+  CHECK( model.CachedProjections() == 40 );
+
+  Tensor1 w0 = Tensor1::Random(50), w1 = Tensor1::Random(25);
+  for(int v=0;v<40;++v) {
+    MultilinearModel model_v = model.project(vector<int>(1, v));
+    CHECK( (models[v].GetCore().Flatten() - model_v.GetCore().Flatten()).norm() == 0 );
+    models[v].ApplyWeights(w0, w1);
+    model_v.ApplyWeights(w0, w1);
+    CHECK( (models[v].GetTM() - model_v.GetTM()).norm() < 1e-12 );
+  }
+
+  // a change of precision starts a new cache
+  copy.SetPrecision(MultilinearModel::Mixed);
+  CHECK( copy.CachedProjections() == 0 );
+  CHECK( copy.projected(3).GetPrecision() == MultilinearModel::Mixed );
+  CHECK( model.CachedProjections() == 40 );
+}
+
+TEST_CASE("Vertex subsets", "[MultilinearModel]") {
+  MultilinearModel model = RandomModel(40);
+  vector<int> region{2, 31, 8, 9};
+  MultilinearModel copy = model;
+  CHECK( !copy.HasSubset("region") );
+  model.DefineSubset("region", region);
+  CHECK( copy.HasSubset("region") );
+
+  Tensor1 w0 = Tensor1::Random(50), w1 = Tensor1::Random(25), tm;
+  copy.ApplyWeightsToSubset("region", w0, w1, tm);
+  model.ApplyWeights(w0, w1);
+  REQUIRE( tm.size() == 12 );
+  for(int k=0;k<4;++k) {
+    CHECK( (tm.segment(3 * k, 3) - model.GetTM().segment(3 * region[k], 3)).norm() < 1e-10 );
+  }
+
+  // a redefinition replaces the vertices
+  model.DefineSubset("region", vector<int>{5});
+  model.ApplyWeightsToSubset("region", w0, w1, tm);
+  CHECK( (tm - model.GetTM().segment(15, 3)).norm() < 1e-10 );
+
+  CHECK_THROWS( model.ApplyWeightsToSubset("contour", w0, w1, tm) );
+  CHECK_THROWS( model.project(region).DefineSubset("region", region) );
+
+  // a change of precision defines the subsets again at the new precision
+  model.DefineSubset("region", region);
+  model.SetPrecision(MultilinearModel::Int8);
+  REQUIRE( model.HasSubset("region") );
+  model.ApplyWeightsToSubset("region", w0, w1, tm);
+  model.ApplyWeights(w0, w1);
+  REQUIRE( tm.size() == 12 );
+  for(int k=0;k<4;++k) {
+    CHECK( (tm.segment(3 * k, 3) - model.GetTM().segment(3 * region[k], 3)).norm() < 1e-8 );
+  }
+}
+
+TEST_CASE("Shared models", "[MultilinearModel]") {
+  Tensor3 core(6, 5, 12);
+  for(size_t i=0;i<core.size();++i) core.rawptr()[i] = std::sin(double(i));
+  const string filename = "test_shared_model.tensor";
+  core.Write(filename);
+
+  MultilinearModel a = MultilinearModel::Shared(filename);
+  MultilinearModel b = MultilinearModel::Shared(filename);
+  CHECK( a.GetCore().rawptr() == b.GetCore().rawptr() );
+  a.PreloadProjections(vector<int>{1, 2});
+  CHECK( b.CachedProjections() == 2 );
+
+  // weights and results stay per instance
+  Tensor1 w0 = Tensor1::Random(6), w1 = Tensor1::Random(5);
+  a.ApplyWeights(w0, w1);
+  b.ApplyWeights(w0, 2 * w1);
+  CHECK( (2 * a.GetTM() - b.GetTM()).norm() < 1e-10 );
+
+  // a change of precision leaves the other users and the core alone
+  const double *p_core = a.GetCore().rawptr();
+  b.SetPrecision(MultilinearModel::Int8);
+  CHECK( b.GetCore().size() == 0 );
+  CHECK( a.GetCore().rawptr() == p_core );
+  CHECK( a.GetPrecision() == MultilinearModel::Double );
+  a.ApplyWeights(w0, w1);
+  CHECK( (a.GetTM() - core.ModeProduct<0>(w0).ModeProduct<0>(w1)).norm() < 1e-10 );
+
+  // the core data of earlier precisions is freed, only the core is shared
+  MultilinearModel c = a;
+  c.SetPrecision(MultilinearModel::Mixed);
+  c.SetPrecision(MultilinearModel::Double);
+  c.SetPrecision(MultilinearModel::Mixed);
+  CHECK( c.GetCore().rawptr() == p_core );
+  CHECK( a.GetCore().GetStorage().use_count() == 2 );
+
+  // concurrent first uses all end up with the model that was published
+  const string other = "test_shared_model_2.tensor";
+  core.Write(other);
+  vector<MultilinearModel> models(8);
+  #pragma omp parallel for
+  for(int t=0;t<8;++t) models[t] = MultilinearModel::Shared(other);
+  for(int t=1;t<8;++t) CHECK( models[t].GetCore().rawptr() == models[0].GetCore().rawptr() );
+
+  // once the last user is gone the file is read again
+  models.clear();
+  MultilinearModel d = MultilinearModel::Shared(other);
+  CHECK( d.GetCore() == core );
+  remove(other.c_str());
+  remove(filename.c_str());
+}
+
+TEST_CASE("Reduced precision models", "[MultilinearModel]") {
+  MultilinearModel model = RandomModel(40);
+  Tensor1 w0 = Tensor1::Random(50), w1 = Tensor1::Random(25);
+  model.ApplyWeights(w0, w1);
+  Tensor1 tm = model.GetTM();
+  // double precision evaluates on the core alone
+  const Tensor3 core = model.GetCore();
+  const size_t core_bytes = sizeof(double) * core.size();
+  CHECK( model.CoreBytes() == core_bytes );
+
+  // mixed precision adds a single precision copy, fp16 and int8 keep only
+  // the quantized core
+  const MultilinearModel::Precision precisions[] = {
+    MultilinearModel::Mixed, MultilinearModel::Half, MultilinearModel::Int8
+  };
+  const double tolerances[] = {1e-6, 1e-3, 2e-2};
+  const size_t max_bytes[] = {core_bytes + core_bytes / 2, core_bytes / 4 + core_bytes / 40,
+                              core_bytes / 8 + core_bytes / 40};
+  for(int p=0;p<3;++p) {
+    MultilinearModel model_p = model;
+    model_p.SetPrecision(precisions[p]);
+    model_p.ApplyWeights(w0, w1);
+    CHECK( (model_p.GetTM() - tm).norm() / tm.norm() < tolerances[p] );
+    CHECK( model_p.CoreBytes() <= max_bytes[p] );
+    CHECK( model_p.ReportPrecisionError(w0, w1, &core) < tolerances[p] );
+    CHECK( (model_p.GetCore().size() == 0) == (precisions[p] != MultilinearModel::Mixed) );
+
+    // projected models keep the precision, and evaluate like the full model
+    MultilinearModel model_i = model_p.project(vector<int>{3, 17});
+    CHECK( model_i.GetPrecision() == precisions[p] );
+    model_i.ApplyWeights(w0, w1);
+    CHECK( (model_i.GetTM().head(3) - model_p.GetTM().segment(9, 3)).norm() < 1e-6 );
+    CHECK( (model_i.GetTM().tail(3) - model_p.GetTM().segment(51, 3)).norm() < 1e-6 );
+
+    // and back to double precision, from the dequantized core
+    model_p.SetPrecision(MultilinearModel::Double);
+    model_p.ApplyWeights(w0, w1);
+    CHECK( model_p.CoreBytes() == core_bytes );
+    CHECK( (model_p.GetTM() - tm).norm() / tm.norm() < tolerances[p] );
+  }
+}
@@ -1,7 +1,10 @@
 #define CATCH_CONFIG_MAIN
+// lets the tests check that a product allocates nothing
+#define EIGEN_RUNTIME_NO_MALLOC
 #include "../third_party/Catch/include/catch.hpp"
 
 #include "../tensor.hpp"
+#include "../streaminghosvd.h"
 
 TEST_CASE("Tensor construction", "[all tensors]") {
   CHECK_NOTHROW( Tensor1(10) );
@@ -56,6 +59,18 @@ TEST_CASE("Tensor unfolding/folding", "[all tensors]") {
     CHECK( i == t2_unfolded(i));
   }
 
+  // folds and their zero-copy views
+  CHECK( Tensor2::FoldByColumn(t2_unfolded, 3, 2) == t2 );
+  auto rv = Tensor2::RowMajorView(t2_unfolded, 3, 2);
+  CHECK( rv.data() == t2_unfolded.data() );
+  CHECK( Tensor2(rv) == t2 );
+  const Tensor2 t2_byrow{{0, 3}, {1, 4}, {2, 5}};
+  CHECK( Tensor2::FoldByRow(t2_unfolded, 3, 2) == t2_byrow );
+  auto cv = Tensor2::ColMajorView(t2_unfolded, 3, 2);
+  CHECK( cv.data() == t2_unfolded.data() );
+  CHECK( Tensor2(cv) == t2_byrow );
+  CHECK( t2_byrow.Flatten() == t2_unfolded );
+
   Tensor3 t3{ { {0, 1, 2, 3},
                 {4, 5, 6, 7},
                 {8, 9, 10, 11} },
@@ -95,6 +110,60 @@ TEST_CASE("Tensor unfolding/folding", "[all tensors]") {
   CHECK( t3new3 == t3 );
 }
 
+TEST_CASE("Tensor views", "[Tensor3]") {
+  Tensor3 t3{ { {0, 1, 2, 3},
+                {4, 5, 6, 7},
+                {8, 9, 10, 11} },
+              { {12, 13, 14, 15},
+                {16, 17, 18, 19},
+                {20, 21, 22, 23} } };
+
+  for(int i=0;i<t3.layers();++i) {
+    auto li = t3.layer(i);
+    CHECK( 3 == li.rows() );
+    CHECK( 4 == li.cols() );
+    for(int j=0;j<t3.rows();++j)
+      for(int k=0;k<t3.cols();++k)
+        CHECK( t3(i, j, k) == li(j, k) );
+  }
+
+  auto v0 = t3.ModeView0();
+  CHECK( 2 == v0.rows() );
+  CHECK( 12 == v0.cols() );
+  auto v1 = t3.ModeView1();
+  CHECK( 3 == v1.rows() );
+  CHECK( 8 == v1.cols() );
+  for(int i=0;i<t3.layers();++i) {
+    for(int j=0;j<t3.rows();++j) {
+      for(int k=0;k<t3.cols();++k) {
+        CHECK( t3(i, j, k) == v0(i, k*t3.rows()+j) );
+        CHECK( t3(i, j, k) == v1(j, i*t3.cols()+k) );
+      }
+    }
+  }
+
+  // copies own their storage
+  Tensor3 t3copy = t3;
+  t3copy(1, 2, 3) = -1;
+  CHECK( 23 == t3(1, 2, 3) );
+  CHECK( t3copy != t3 );
+  CHECK( std::sqrt(4324.0) == Approx(t3.norm()) );
+
+  // a view aliases the block of its owner until it is assigned to
+  const Tensor3 t3ref = t3;
+  Tensor3 view = Tensor3::View(t3.GetStorage(), t3.rawptr() + 12, 1, 3, 4);
+  CHECK( view(0, 2, 3) == 23 );
+  Tensor3 other(1, 3, 4);
+  for(size_t i=0;i<other.size();++i) other.rawptr()[i] = -1.0 * i;
+  view = other;
+  CHECK( view == other );
+  CHECK( t3 == t3ref );
+  view = Tensor3::View(t3.GetStorage(), t3.rawptr(), 1, 3, 4);
+  view.resize(1, 4, 3);
+  view(0, 0, 0) = 100;
+  CHECK( t3 == t3ref );
+}
+
 TEST_CASE("Tensor mode products", "[all tensors]") {
   Tensor2 t2{{0, 1}, {2, 3}, {4, 5}};
 
@@ -122,6 +191,35 @@ TEST_CASE("Tensor mode products", "[all tensors]") {
   const Tensor3 tm2_ref{{{33, 71, 66}, {133, 223, 238}, {233, 375, 410}},
                         {{333, 527, 582}, {433, 679, 754}, {533, 831, 926}}};
   CHECK( tm2_ref == tm2 );
+
+  // in-place products
+  Tensor3 t3a = t3;
+  t3a.ModeProduct<1>(t22, t3a);
+  CHECK( tm1_ref == t3a );
+  t3a = t3;
+  t3a.ModeProduct<2>(t23, t3a);
+  CHECK( tm2_ref == t3a );
+}
+
+TEST_CASE("Tensor transposed mode 1 product", "[Tensor3]") {
+  // distinct sizes, so that a transposed layout cannot pass
+  Tensor3 t(4, 3, 7);
+  for(size_t i=0;i<t.size();++i) t.rawptr()[i] = std::sin(i + 1.0);
+  Tensor1 v = Tensor1::Random(3);
+
+  Tensor2 A = t.ModeProduct<1>(v), At;
+  t.TransposedModeProduct1(v, At);
+  REQUIRE( At.rows() == 7 );
+  REQUIRE( At.cols() == 4 );
+  CHECK( (At.GetData() - A.GetData().transpose()).norm() < 1e-12 );
+
+  // the GEMV writes straight into At, without a temporary
+  const double *storage = At.rawptr();
+  Eigen::internal::set_is_malloc_allowed(false);
+  t.TransposedModeProduct1(v, At);
+  Eigen::internal::set_is_malloc_allowed(true);
+  CHECK( At.rawptr() == storage );
+  CHECK( (At.GetData() - A.GetData().transpose()).norm() < 1e-12 );
 }
 
 TEST_CASE("Tensor SVD", "[Tensor3]") {
@@ -184,4 +282,464 @@ TEST_CASE("Tensor SVD", "[Tensor3]") {
     trecon = trecon.ModeProduct(tui, modes[i]);
   }
   CHECK( (trecon - t3).norm() < 1e-10 );
-}
\ No newline at end of file
+}
+TEST_CASE("Tensor truncated SVD methods", "[Tensor3]") {
+  // a tensor with a known multilinear rank of (3, 2, 4), plus small noise
+  std::mt19937 gen(7);
+  std::normal_distribution<double> normal;
+  auto random_matrix = [&](int r, int c) {
+    Tensor2 A(r, c);
+    for(int i=0;i<r;++i) for(int j=0;j<c;++j) A(i, j) = normal(gen);
+    return A;
+  };
+  Tensor3 core(3, 2, 4);
+  for(size_t i=0;i<core.size();++i) core.rawptr()[i] = normal(gen);
+  Tensor3 t = core.ModeProduct(random_matrix(8, 3), 0)
+                  .ModeProduct(random_matrix(6, 2), 1)
+                  .ModeProduct(random_matrix(40, 4), 2);
+  for(size_t i=0;i<t.size();++i) t.rawptr()[i] += 1e-6 * normal(gen);
+
+  vector<int> modes{0, 1, 2};
+  vector<int> dims{3, 2, 4};
+  for(int mid=0;mid<3;++mid) {
+    MatrixXd U_ref = t.LeadingSingularVectors(mid, dims[mid], Tensor3::Jacobi);
+    for(auto method : {Tensor3::Gram, Tensor3::Randomized}) {
+      VectorXd s;
+      MatrixXd U = t.LeadingSingularVectors(mid, dims[mid], method, &s);
+      CHECK( U.rows() == t.dim(mid) );
+      CHECK( U.cols() == dims[mid] );
+      CHECK( (U.transpose() * U - MatrixXd::Identity(dims[mid], dims[mid])).norm() < 1e-8 );
+      // the columns agree with the reference up to sign
+      CHECK( ((U.transpose() * U_ref).cwiseAbs() - MatrixXd::Identity(dims[mid], dims[mid])).norm() < 1e-6 );
+      CHECK( s.size() == dims[mid] );
+    }
+  }
+
+  for(auto method : {Tensor3::Gram, Tensor3::Randomized, Tensor3::Auto}) {
+    auto comp = t.svd(modes, dims, method);
+    Tensor3 trecon = std::get<0>(comp);
+    auto tus = std::get<1>(comp);
+    for(size_t i=0;i<modes.size();i++) {
+      trecon = trecon.ModeProduct(tus[i], modes[i]);
+    }
+    CHECK( (trecon - t).norm() < 1e-4 );
+  }
+}
+
+TEST_CASE("Tensor HOOI", "[Tensor3]") {
+  std::mt19937 gen(11);
+  std::normal_distribution<double> normal;
+  Tensor3 t(6, 7, 30);
+  for(size_t i=0;i<t.size();++i) t.rawptr()[i] = normal(gen);
+
+  vector<int> modes{0, 1, 2};
+  vector<int> dims{3, 3, 4};
+  auto reconstruct = [&](const tuple<Tensor3, vector<Tensor2>> &comp) {
+    Tensor3 trecon = std::get<0>(comp);
+    auto tus = std::get<1>(comp);
+    for(size_t i=0;i<modes.size();i++) {
+      trecon = trecon.ModeProduct(tus[i], modes[i]);
+    }
+    return trecon;
+  };
+
+  double hosvd_err = (reconstruct(t.svd(modes, dims, Tensor3::Gram)) - t).norm();
+  auto comp = t.hooi(modes, dims, 20, 1e-10, Tensor3::Gram);
+  double hooi_err = (reconstruct(comp) - t).norm();
+  CHECK( hooi_err <= hosvd_err + 1e-10 );
+
+  // the factors stay orthonormal and the core is the projection of t
+  auto tus = std::get<1>(comp);
+  for(size_t i=0;i<modes.size();i++) {
+    const MatrixXd &U = tus[i].GetData();
+    CHECK( (U.transpose() * U - MatrixXd::Identity(dims[i], dims[i])).norm() < 1e-8 );
+  }
+  Tensor3 core = t;
+  for(size_t i=0;i<modes.size();i++) {
+    core = core.ModeProduct(Tensor2(tus[i].GetData().transpose()), modes[i]);
+  }
+  CHECK( (core - std::get<0>(comp)).norm() < 1e-8 );
+}
+
+TEST_CASE("Tensor file formats", "[all tensors]") {
+  Tensor3 t3{ { {0, 1, 2, 3},
+                {4, 5, 6, 7},
+                {8, 9, 10, 11} },
+              { {12, 13, 14, 15},
+                {16, 17, 18, 19},
+                {20, 21, 22, 23} } };
+  const Tensor2 t2_ref{{1, 2, 3}, {4, 5, 6}};
+  Tensor2 t2 = t2_ref;
+
+  const string f3 = "test_tensor3.tensor", f2 = "test_tensor2.tensor";
+
+  SECTION("versioned") {
+    REQUIRE( t3.Write(f3) );
+    CHECK( TensorFile::IsVersioned(f3) );
+    Tensor3 r3;
+    REQUIRE( r3.Read(f3) );
+    CHECK( r3 == t3 );
+    CHECK( reinterpret_cast<uintptr_t>(r3.rawptr()) % Tensor3::kAlignment == 0 );
+
+    // the mapping is private, the file is left untouched
+    r3(1, 2, 3) = -1;
+    Tensor3 r3b;
+    REQUIRE( r3b.Read(f3) );
+    CHECK( r3b == t3 );
+
+    REQUIRE( t2.Write(f2) );
+    Tensor2 r2;
+    REQUIRE( r2.Read(f2) );
+    CHECK( r2 == t2_ref );
+  }
+
+  SECTION("legacy") {
+    REQUIRE( t3.Write(f3, true) );
+    CHECK( !TensorFile::IsVersioned(f3) );
+    Tensor3 r3;
+    REQUIRE( r3.Read(f3) );
+    CHECK( r3 == t3 );
+
+    REQUIRE( t2.Write(f2, true) );
+    Tensor2 r2;
+    REQUIRE( r2.Read(f2) );
+    CHECK( r2 == t2_ref );
+  }
+
+  SECTION("corrupted") {
+    REQUIRE( t3.Write(f3) );
+    {
+      fstream f(f3, ios::in | ios::out | ios::binary);
+      f.seekp(sizeof(TensorFileHeader) + 5);
+      f.put(0x7f);
+    }
+    Tensor3 r3;
+    CHECK( !r3.Read(f3) );
+  }
+
+  SECTION("version 1") {
+    // 64-byte header with int dimensions and a single block checksum
+    const double *values = t3.rawptr();
+    TensorFileHeaderV1 v1;
+    memset(&v1, 0, sizeof(v1));
+    memcpy(v1.magic, TensorFile::Magic(), 8);
+    v1.version = 1;
+    v1.byte_order = TensorFileHeader::kByteOrderMark;
+    v1.order = 3;
+    v1.scalar_bytes = sizeof(double);
+    v1.dims[0] = 2; v1.dims[1] = 3; v1.dims[2] = 4;
+    v1.payload_offset = sizeof(v1);
+    v1.payload_bytes = sizeof(double) * t3.size();
+    v1.checksum = TensorFile::Checksum(reinterpret_cast<const char*>(values), v1.payload_bytes);
+    {
+      ofstream f(f3, ios::out | ios::binary);
+      f.write(reinterpret_cast<const char*>(&v1), sizeof(v1));
+      f.write(reinterpret_cast<const char*>(values), v1.payload_bytes);
+    }
+    Tensor3 r3, r3b;
+    REQUIRE( r3.Read(f3) );
+    CHECK( r3 == t3 );
+    REQUIRE( r3b.Read(f3, false) );
+    CHECK( r3b == t3 );
+  }
+
+  SECTION("chunked") {
+    // spans several io chunks and checksum blocks
+    const int n = 2 * TensorFile::kChunkBytes / (sizeof(double) * 6) + 1000;
+    Tensor3 big(2, 3, n);
+    for(size_t i=0;i<big.size();++i) big.rawptr()[i] = i * 0.5;
+
+    REQUIRE( big.Write(f3) );
+    Tensor3 mapped, copied;
+    REQUIRE( mapped.Read(f3) );
+    CHECK( mapped == big );
+    REQUIRE( copied.Read(f3, false) );
+    CHECK( copied == big );
+    CHECK( reinterpret_cast<uintptr_t>(copied.rawptr()) % Tensor3::kAlignment == 0 );
+
+    REQUIRE( big.Write(f3, true) );
+    Tensor3 legacy;
+    REQUIRE( legacy.Read(f3) );
+    CHECK( legacy == big );
+
+    // a flipped byte in the last block is caught
+    REQUIRE( big.Write(f3) );
+    {
+      fstream f(f3, ios::in | ios::out | ios::binary);
+      f.seekp(sizeof(TensorFileHeader) + sizeof(double) * big.size() - 3);
+      f.put(0x7f);
+    }
+    CHECK( !copied.Read(f3, false) );
+  }
+
+  SECTION("write back") {
+    // the tensor read maps the file it is written back to
+    const int n = 2 * TensorFile::kChunkBytes / (sizeof(double) * 6) + 1000;
+    Tensor3 big(2, 3, n);
+    for(size_t i=0;i<big.size();++i) big.rawptr()[i] = i * 0.5;
+    REQUIRE( big.Write(f3) );
+
+    Tensor3 mapped, r3;
+    REQUIRE( mapped.Read(f3) );
+    REQUIRE( mapped.Write(f3) );
+    CHECK( mapped == big );
+    REQUIRE( r3.Read(f3) );
+    CHECK( r3 == big );
+
+    REQUIRE( mapped.Read(f3) );
+    REQUIRE( mapped.WriteCompressed(f3) );
+    CHECK( mapped == big );
+    REQUIRE( r3.Read(f3) );
+    CHECK( r3 == big );
+
+    REQUIRE( big.Write(f3) );
+    REQUIRE( mapped.Read(f3) );
+    REQUIRE( mapped.Write(f3, true) );
+    CHECK( mapped == big );
+    REQUIRE( r3.Read(f3) );
+    CHECK( r3 == big );
+
+    // the replaced file keeps its mode
+    struct stat st;
+    REQUIRE( chmod(f3.c_str(), 0640) == 0 );
+    REQUIRE( t3.Write(f3) );
+    REQUIRE( stat(f3.c_str(), &st) == 0 );
+    CHECK( (st.st_mode & 07777) == 0640 );
+  }
+
+  SECTION("truncated legacy") {
+    REQUIRE( t3.Write(f3, true) );
+    CHECK( truncate(f3.c_str(), 3 * sizeof(int) + 8) == 0 );
+    Tensor3 r3;
+    CHECK( !r3.Read(f3) );
+  }
+
+  remove(f3.c_str());
+  remove(f2.c_str());
+}
+
+TEST_CASE("Compressed tensor files", "[all tensors]") {
+  const string f3 = "test_tensor3.tensor", f2 = "test_tensor2.tensor";
+
+  SECTION("codec") {
+    // runs, overlapping matches and incompressible bytes
+    string in(100000, 'a');
+    std::mt19937 gen(1);
+    for(int i=20000;i<40000;++i) in[i] = static_cast<char>(gen());
+    for(int i=60000;i<61000;++i) in[i] = "abc"[i % 3];
+    vector<char> out(TensorCodec::CompressBound(in.size()));
+    size_t n = TensorCodec::Compress(in.data(), in.size(), out.data());
+    CHECK( n < in.size() );
+    string back(in.size(), 0);
+    REQUIRE( TensorCodec::Decompress(out.data(), n, &back[0], back.size()) );
+    CHECK( back == in );
+    CHECK( !TensorCodec::Decompress(out.data(), n / 2, &back[0], back.size()) );
+    CHECK( !TensorCodec::Decompress(out.data(), n, &back[0], back.size() - 1) );
+  }
+
+  SECTION("round trip") {
+    // smooth values share their high bytes, spread over several chunks
+    const int n = TensorFile::kChunkBytes / (sizeof(double) * 6) + 777;
+    Tensor3 t(2, 3, n);
+    std::mt19937 gen(2);
+    std::uniform_real_distribution<double> dist(-1e-3, 1e-3);
+    for(size_t i=0;i<t.size();++i) t.rawptr()[i] = std::sin(i * 1e-4) + dist(gen);
+    t(1, 2, n - 1) = std::numeric_limits<double>::quiet_NaN();
+
+    REQUIRE( t.WriteCompressed(f3) );
+    Tensor3 r;
+    REQUIRE( r.Read(f3) );
+    REQUIRE( r.size() == t.size() );
+    CHECK( memcmp(r.rawptr(), t.rawptr(), sizeof(double) * t.size()) == 0 );
+    CHECK( reinterpret_cast<uintptr_t>(r.rawptr()) % Tensor3::kAlignment == 0 );
+
+    struct stat st;
+    REQUIRE( stat(f3.c_str(), &st) == 0 );
+    CHECK( static_cast<size_t>(st.st_size) < sizeof(double) * t.size() );
+
+    Tensor2 t2(MatrixXd::Random(37, 11));
+    REQUIRE( t2.WriteCompressed(f2) );
+    Tensor2 r2;
+    REQUIRE( r2.Read(f2) );
+    CHECK( r2 == t2 );
+  }
+
+  SECTION("byte strings") {
+    // sizes that are not a multiple of 8
+    string bytes(12345, 'x');
+    for(int i=0;i<1000;++i) bytes[i * 7] = static_cast<char>(i);
+    double ratio = 0;
+    REQUIRE( TensorFile::WriteBytes(f2, bytes, TensorFile::ShuffleLZ, &ratio) );
+    CHECK( ratio > 1 );
+    CHECK( TensorFile::ReadBytes(f2) == bytes );
+
+    // plain files are passed through
+    {
+      ofstream f(f2, ios::out | ios::binary);
+      f << bytes;
+    }
+    CHECK( TensorFile::ReadBytes(f2) == bytes );
+  }
+
+  SECTION("corrupted") {
+    Tensor3 t(4, 5, 600);
+    for(size_t i=0;i<t.size();++i) t.rawptr()[i] = (i % 97) * 0.25;
+    REQUIRE( t.WriteCompressed(f3) );
+    {
+      fstream f(f3, ios::in | ios::out | ios::binary);
+      f.seekp(sizeof(TensorFileHeader) + 40);
+      f.put(0x55);
+    }
+    Tensor3 r;
+    CHECK( !r.Read(f3) );
+  }
+
+  remove(f3.c_str());
+  remove(f2.c_str());
+}
+
+TEST_CASE("Tensor single precision mode products", "[Tensor3]") {
+  std::mt19937 gen(3);
+  std::uniform_real_distribution<double> dist(-1.0, 1.0);
+  Tensor3 t(5, 4, 1100);
+  for(size_t i=0;i<t.size();++i) t.rawptr()[i] = dist(gen);
+  Tensor3f tf(t);
+
+  CHECK( tf.layers() == 5 );
+  CHECK( tf.rows() == 4 );
+  CHECK( tf.cols() == 1100 );
+  CHECK( tf(2, 3, 1000) == static_cast<float>(t(2, 3, 1000)) );
+  CHECK( (tf.ToDouble() - t).norm() / t.norm() < 1e-7 );
+
+  Tensor1 v0 = Tensor1::Random(5), v1 = Tensor1::Random(4), v2 = Tensor1::Random(1100);
+  auto rel_err = [](const Tensor2 &a, const Tensor2 &b) {
+    return (a - b).norm() / b.norm();
+  };
+  CHECK( rel_err(tf.ModeProduct<0>(v0), t.ModeProduct<0>(v0)) < 1e-6 );
+  CHECK( rel_err(tf.ModeProduct<1>(v1), t.ModeProduct<1>(v1)) < 1e-6 );
+  Tensor2 At;
+  tf.TransposedModeProduct1(v1, At);
+  CHECK( rel_err(At, Tensor2(t.ModeProduct<1>(v1).GetData().transpose())) < 1e-6 );
+  CHECK( rel_err(tf.ModeProduct<2>(v2), t.ModeProduct<2>(v2)) < 1e-6 );
+}
+
+TEST_CASE("Tensor mode product chains", "[Tensor3]") {
+  std::mt19937 gen(13);
+  std::uniform_real_distribution<double> dist(-1.0, 1.0);
+  Tensor3 t(6, 5, 40);
+  for(size_t i=0;i<t.size();++i) t.rawptr()[i] = dist(gen);
+  auto random_matrix = [&](int r, int c) {
+    Tensor2 A(r, c);
+    for(int i=0;i<r;++i) for(int j=0;j<c;++j) A(i, j) = dist(gen);
+    return A;
+  };
+  Tensor2 A0 = random_matrix(3, 6), A1 = random_matrix(7, 5), A2 = random_matrix(2, 40);
+
+  ModeProductChain chain(t);
+  chain.ModeProduct(A0, 0).ModeProduct(A1, 1).ModeProduct(A2, 2);
+  Tensor3 ref = t.ModeProduct(A0, 0).ModeProduct(A1, 1).ModeProduct(A2, 2);
+  CHECK( (chain.Eval() - ref).norm() < 1e-10 );
+
+  // shrinking mode 2 first is the cheapest, mode 1 grows and goes last
+  CHECK( chain.Order() == (vector<int>{2, 0, 1}) );
+  CHECK( chain.Cost(chain.Order()) <= chain.Cost({0, 1, 2}) );
+
+  // repeated evaluations reuse the caller's buffers
+  Tensor3 res;
+  ModeProductChain::Workspace ws;
+  chain.Eval(res, ws);
+  const double *storage[3] = {res.rawptr(), ws.buf[0].rawptr(), ws.buf[1].rawptr()};
+  chain.Eval(res, ws);
+  CHECK( (res - ref).norm() < 1e-10 );
+  CHECK( res.rawptr() == storage[0] );
+  CHECK( ws.buf[0].rawptr() == storage[1] );
+  CHECK( ws.buf[1].rawptr() == storage[2] );
+
+  // products on the same mode keep their order
+  Tensor2 B0 = random_matrix(4, 3);
+  ModeProductChain chain2(t);
+  chain2.ModeProduct(A0, 0).ModeProduct(A2, 2).ModeProduct(B0, 0);
+  CHECK( (chain2.Eval() - t.ModeProduct(A0, 0).ModeProduct(B0, 0).ModeProduct(A2, 2)).norm() < 1e-10 );
+
+  // vector products leave a mode of dimension 1
+  Tensor1 v0 = Tensor1::Random(6), v1 = Tensor1::Random(5);
+  Tensor3 tv = ModeProductChain(t).ModeProduct(v0, 0).ModeProduct(v1, 1).Eval();
+  CHECK( tv.layers() == 1 );
+  CHECK( tv.rows() == 1 );
+  Tensor1 tm = t.ModeProduct<0>(v0).ModeProduct<0>(v1);
+  CHECK( (tv.Flatten() - tm).norm() < 1e-10 );
+}
+
+TEST_CASE("Tensor quantized mode products", "[Tensor3]") {
+  std::mt19937 gen(17);
+  std::uniform_real_distribution<double> dist(-1.0, 1.0);
+  Tensor3 t(6, 5, 300);
+  for(int i=0;i<6;++i) for(int j=0;j<5;++j) for(int k=0;k<300;++k)
+    t(i, j, k) = 10.0 * i - 3.0 * j + (j + 1) * dist(gen);
+
+  Tensor3h th(t);
+  Tensor3i8 tq(t);
+  CHECK( th.bytes() < t.size() * sizeof(double) / 3 );
+  CHECK( tq.bytes() < t.size() * sizeof(double) / 6 );
+
+  // the error of each element is bounded by half a step of its slice
+  double max_err_h = (th.ToDouble() - t).Flatten().cwiseAbs().maxCoeff();
+  double max_err_q = (tq.ToDouble() - t).Flatten().cwiseAbs().maxCoeff();
+  CHECK( max_err_h < 5 * 1e-3 );
+  CHECK( max_err_q < 5.0 / 127 );
+
+  Tensor1 v0 = Tensor1::Random(6), v1 = Tensor1::Random(5);
+  Tensor3 tqd = tq.ToDouble();
+  CHECK( (tq.ModeProduct<0>(v0) - tqd.ModeProduct<0>(v0)).norm() < 1e-8 );
+  CHECK( (tq.ModeProduct<1>(v1) - tqd.ModeProduct<1>(v1)).norm() < 1e-8 );
+  Tensor3 thd = th.ToDouble();
+  CHECK( (th.ModeProduct<0>(v0) - thd.ModeProduct<0>(v0)).norm() < 1e-8 );
+  CHECK( (th.ModeProduct<1>(v1) - thd.ModeProduct<1>(v1)).norm() < 1e-8 );
+  Tensor2 At;
+  th.TransposedModeProduct1(v1, At);
+  CHECK( (At.GetData() - thd.ModeProduct<1>(v1).GetData().transpose()).norm() < 1e-8 );
+  tq.TransposedModeProduct1(v1, At);
+  CHECK( (At.GetData() - tqd.ModeProduct<1>(v1).GetData().transpose()).norm() < 1e-8 );
+}
+
+TEST_CASE("Streaming HOSVD", "[Tensor3]") {
+  std::mt19937 gen(19);
+  std::normal_distribution<double> normal;
+  Tensor3 t(9, 6, 50);
+  for(size_t i=0;i<t.size();++i) t.rawptr()[i] = normal(gen);
+
+  int loads = 0;
+  auto loader = [&](int i, MatrixXd &S) {
+    S = t.layer(i);
+    ++loads;
+  };
+
+  vector<int> modes{0, 1};
+  vector<int> dims{4, 3};
+  auto comp_ref = t.svd(modes, dims, Tensor3::Gram);
+  const MatrixXd &U0_ref = std::get<1>(comp_ref)[0].GetData();
+  const MatrixXd &U1_ref = std::get<1>(comp_ref)[1].GetData();
+
+  // room for everything, a few slices, and a single slice
+  const size_t slice_bytes = sizeof(double) * 6 * 50;
+  const size_t fixed = sizeof(double) * (4 * 3 * 50 + 81) + 2 * slice_bytes;
+  for(size_t budget : {size_t(1) << 30, fixed + 4 * slice_bytes, size_t(0)}) {
+    loads = 0;
+    StreamingHOSVD hosvd(9, 6, 50, loader, budget);
+    auto comp = hosvd.Compute(4, 3);
+    const Tensor3 &core = std::get<0>(comp);
+    auto tus = std::get<1>(comp);
+
+    // same subspaces as the in-memory decomposition
+    CHECK( ((tus[0].GetData().transpose() * U0_ref).cwiseAbs() - MatrixXd::Identity(4, 4)).norm() < 1e-8 );
+    CHECK( ((tus[1].GetData().transpose() * U1_ref).cwiseAbs() - MatrixXd::Identity(3, 3)).norm() < 1e-8 );
+
+    Tensor3 recon = core.ModeProduct(tus[0], 0).ModeProduct(tus[1], 1);
+    double max_err = (recon - t).Flatten().cwiseAbs().maxCoeff();
+    CHECK( std::abs(hosvd.MaxReconstructionError(core, tus) - max_err) < 1e-10 );
+
+    // when everything fits: one pass each for the Gram matrices, the core and
+    // the reconstruction error
+    if( budget == (size_t(1) << 30) ) CHECK( loads == 3 * 9 );
+  }
+}